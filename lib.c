@@ -101,6 +101,43 @@ void USART_Transmit( unsigned char data ) {
 	UDR0 = data;
 }
 
+int USART_Poll() {
+	/* Check if a byte was received */
+	if (!(UCSR0A & (1<<RXC0))) return -1;
+	return UDR0;
+}
+
+void USART_Flush() {
+	/* Wait for empty transmit buffer */ 
+	while ( !( UCSR0A & (1<<UDRE0)) );
+	/* Wait for the last byte to leave the shift register, 2ms is a full frame at 9600 baud */
+	_delay_ms(2);
+}
+
+int USART_BaudError(unsigned long baud, unsigned int* ubrr) {
+	/* In double speed mode the baud rate is FOSC/8/(UBRR+1), round to the closest divisor */
+	unsigned long divisor = (FOSC + 4*baud) / (8*baud);
+	if (divisor < 1 || divisor > 4096) return -1;
+	*ubrr = divisor - 1;
+	unsigned long actual = FOSC / (8*divisor);
+	unsigned long diff = (actual > baud) ? actual - baud : baud - actual;
+	return diff * 1000 / baud;
+}
+
+int USART_SetSpeed(unsigned long baud) {
+	unsigned int ubrr;
+	int error = USART_BaudError(baud, &ubrr);
+	if (error < 0 || error > USART_MAX_ERROR) return -1;
+	USART_Flush();
+	UBRR0H = (unsigned char)(ubrr>>8); 
+	UBRR0L = (unsigned char)ubrr;
+	/* Double speed */
+	UCSR0A = (1<<U2X0);
+	/* Set frame format: 8data, 1stop bit */ 
+	UCSR0C = (3<<UCSZ00);
+	return error;
+}
+
 
 void printNumber(int x) {
 	char buffer[8];
@@ -115,6 +152,27 @@ void printNumber(int x) {
 	}
 }
 
+void printUnsigned(unsigned int x) {
+	char digits[5]; // a 16 bit int has at most 5 digits
+	int count = 0;
+	do {
+		digits[count++] = '0' + x % 10;
+		x /= 10;
+	} while (x > 0);
+	while (count > 0) {
+		USART_Transmit(digits[--count]);
+	}
+}
+
+void printDecimal(int x) {
+	unsigned int u = x;
+	if (x < 0) {
+		USART_Transmit('-');
+		u = -u;
+	}
+	printUnsigned(u);
+}
+
 /*
    _____        /\ ________    _________                                        .__               
   /  _  \      / / \______ \   \_   ___ \  ____   _______  __ ___________  _____|__| ____   ____  
@@ -139,6 +197,79 @@ unsigned char readAnalog(unsigned char pin) {
 	return ADCval;
 }
 
+/*
+___________.__                     
+\__    ___/|__| _____   ___________ 
+  |    |   |  |/     \_/ __ \_  __ \
+  |    |   |  |  Y Y  \  ___/|  | \/
+  |____|   |__|__|_|  /\___  >__|   
+                    \/     \/       
+*/
+void initTimer() {
+	TCCR1A = 0;           // normal mode, count up to 0xFFFF and wrap
+	TCCR1B = (1<<CS12);   // set prescale to 256, one tick every 16us
+}
+
+unsigned int readTimer() {
+	return TCNT1;
+}
+
+int ticksUntil(unsigned int deadline) {
+	// The difference is interpreted as signed so it keeps working when the timer wraps
+	return (int)(deadline - readTimer());
+}
+
+void waitUntil(unsigned int deadline) {
+	while (ticksUntil(deadline) > 0);
+}
+
+// The compare match only wakes the CPU, there is nothing left to do here
+void TIMER1_COMPA_vect(void) __attribute__((signal, used, externally_visible));
+void TIMER1_COMPA_vect(void) {
+}
+
+void sleepUntil(unsigned int deadline) {
+	unsigned char sreg = AVR_S;
+	OCR1A = deadline;
+	TIFR1 = (1<<OCF1A);     // clear an old match, the flag is cleared by writing a one
+	sbi(TIMSK1,OCIE1A);
+	SMCR = (1<<SE);
+	while (1) {
+		__asm__ __volatile__ ("cli");
+		if (ticksUntil(deadline) <= 0) break;
+		// The instruction after sei always runs first, so the match can not be handled before we sleep
+		__asm__ __volatile__ ("sei\n\tsleep");
+	}
+	SMCR = 0;
+	cbi(TIMSK1,OCIE1A);
+	AVR_S = sreg;
+}
+
+// Both come from avr-libc: the start of the heap and its current end (0 until the first malloc)
+extern char __heap_start;
+extern char *__brkval;
+
+static unsigned char* heapEnd() {
+	return (unsigned char*) (__brkval ? __brkval : &__heap_start);
+}
+
+void paintStack() {
+	unsigned char* p = heapEnd();
+	// SP points to the first free byte, everything below it is unused
+	while (p < (unsigned char*) (uintptr_t) SP) {
+		*p++ = STACK_PAINT;
+	}
+}
+
+unsigned int unusedStack() {
+	unsigned char* p = heapEnd();
+	unsigned int count = 0;
+	while (p + count < (unsigned char*) (uintptr_t) SP && p[count] == STACK_PAINT) {
+		count++;
+	}
+	return count;
+}
+
 /*
   ___________________.___  __________                __                      .__   
  /   _____/\______   \   | \______   \_______  _____/  |_  ____   ____  ____ |  |  
@@ -152,7 +283,10 @@ void pulsePin(int pin) {
   setPin(PORTB,pin);
 }
 
+static unsigned int spiCount = 0;
+
 void sendSPIData(int data) {
+	spiCount++;
 	clearPin(PORTB,CS);
 	int mask = 1<<8;
 	while(mask > 0) {
@@ -257,6 +391,10 @@ void clearScreen() {
 	fillRectangle(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, BLACK);
 }
 
+unsigned int readSPICount() {
+	return spiCount;
+}
+
 
 int readPulse(int pin) {
 	int high = 0;
@@ -277,10 +415,19 @@ int readPulse(int pin) {
 
 // ADT Ball
 void move(Ball* self,int x, int y) {
-	fillRectangle(self->x_pos, self->y_pos, self->width,self->height, BLACK);
+	if (self->drawn_x != NOT_DRAWN) {
+		fillRectangle(self->drawn_x, self->drawn_y, self->width,self->height, BLACK);
+	}
 	self->x_pos = x;
 	self->y_pos = y;
 	fillRectangle(self->x_pos, self->y_pos, self->width,self->height, self->color);
+	self->drawn_x = x;
+	self->drawn_y = y;
+};
+
+void place(Ball* self,int x, int y) {
+	self->x_pos = x;
+	self->y_pos = y;
 };
 
 Ball* createBall(int x,int y,int w,int h) {
@@ -291,19 +438,56 @@ Ball* createBall(int x,int y,int w,int h) {
 		ball->width = w;
 		ball->height = h;
 		ball->x_pos = x;
-		ball->y_pos = x;
+		ball->y_pos = y;
 		ball->color = WHITE;
+		ball->drawn_x = NOT_DRAWN;
+		ball->drawn_y = NOT_DRAWN;
 		ball->move = move;
+		ball->place = place;
 	}
 	return ball;
 }
 
+static int isMoved(Ball* b) {
+	return b->drawn_x != b->x_pos || b->drawn_y != b->y_pos;
+}
+
+/* Checks if the ball at its new position overlaps the area at (x,y) that was erased for another ball */
+static int overlapsErased(Ball* b, int x, int y, int width, int height) {
+	return b->x_pos < x + width && x < b->x_pos + b->width && b->y_pos < y + height && y < b->y_pos + b->height;
+}
+
+void renderBalls(Ball* balls[], int count) {
+	unsigned char redraw = 0; // one bit per ball
+	int i, j;
+	for (i = 0; i < count; i++) {
+		Ball* b = balls[i];
+		if (!isMoved(b)) continue;
+		redraw |= 1<<i;
+		if (b->drawn_x == NOT_DRAWN) continue;
+		fillRectangle(b->drawn_x, b->drawn_y, b->width, b->height, BLACK);
+		for (j = 0; j < count; j++) {
+			if (j != i && overlapsErased(balls[j], b->drawn_x, b->drawn_y, b->width, b->height)) {
+				redraw |= 1<<j;
+			}
+		}
+	}
+	for (i = 0; i < count; i++) {
+		Ball* b = balls[i];
+		if (!(redraw & (1<<i))) continue;
+		fillRectangle(b->x_pos, b->y_pos, b->width, b->height, b->color);
+		b->drawn_x = b->x_pos;
+		b->drawn_y = b->y_pos;
+	}
+}
+
 //ADT Accelerometer
 direction getDirection(Accelerometer* acc) {
 	if(readPulse(acc->x_pin) < 7920) return RIGHT;	
 	if (readPulse(acc->x_pin)> 9920) return LEFT;		
 	if(readPulse(acc->y_pin) < 7920) return UP;	
 	if (readPulse(acc->y_pin)> 9920) return DOWN;		
+	return NEUTRAL;
 };
 
 int getDetailedDirection(Accelerometer* acc) {
@@ -320,3 +504,259 @@ Accelerometer* newAccelerometer(int x_pin,int y_pin) {
 	acc->getDetailedDirection = getDetailedDirection;
 	return acc;	
 }
+
+/*
+___________                           
+\__    ___/___________    ____  ____  
+  |    |  \_  __ \__  \ _/ ___\/ __ \ 
+  |    |   |  | \// __ \\  \__\  ___/ 
+  |____|   |__|  (____  /\___  >___  >
+                      \/     \/    \/ 
+*/
+static unsigned int traceCount;  // number of records in eeprom
+static unsigned int tracePos;    // next record to replay
+static unsigned char traceRun;   // steps in the current run
+static direction traceDir;       // direction of the current run
+
+static void writeTraceCount() {
+	EEPROM_write(2, traceCount & 0xFF);
+	EEPROM_write(3, traceCount >> 8);
+}
+
+static unsigned int readTraceCount() {
+	unsigned int count = EEPROM_read(2) | (EEPROM_read(3) << 8);
+	// An erased eeprom reads 0xFFFF
+	if (count > TRACE_SIZE - TRACE_HEADER) count = 0;
+	return count;
+}
+
+void traceStart(unsigned int seed) {
+	EEPROM_write(0, seed & 0xFF);
+	EEPROM_write(1, seed >> 8);
+	traceCount = 0;
+	traceRun = 0;
+	writeTraceCount();
+}
+
+void traceRecord(direction d) {
+	if (traceRun > 0 && (d != traceDir || traceRun == TRACE_MAX_RUN)) {
+		traceFlush();
+	}
+	traceDir = d;
+	traceRun++;
+}
+
+void traceFlush() {
+	unsigned char run = traceRun;
+	traceRun = 0;
+	if (run == 0 || TRACE_HEADER + traceCount >= TRACE_SIZE) return;
+	EEPROM_write(TRACE_HEADER + traceCount, (traceDir << 5) | run);
+	traceCount++;
+	writeTraceCount();
+}
+
+unsigned int traceSeed() {
+	return EEPROM_read(0) | (EEPROM_read(1) << 8);
+}
+
+void traceDump() {
+	unsigned int i;
+	unsigned int end = TRACE_HEADER + readTraceCount();
+	for (i = 0; i < end; i++) {
+		USART_Transmit(EEPROM_read(i));
+	}
+}
+
+direction getReplayDirection(Accelerometer* acc) {
+	while (traceRun == 0) {
+		if (tracePos >= traceCount) return NEUTRAL;
+		unsigned char record = EEPROM_read(TRACE_HEADER + tracePos++);
+		traceDir = record >> 5;
+		traceRun = record & TRACE_MAX_RUN;
+	}
+	traceRun--;
+	return traceDir;
+}
+
+Accelerometer* newReplayAccelerometer() {
+	Accelerometer* acc = (Accelerometer*) malloc(sizeof(Accelerometer));
+	acc->x_pin = -1;
+	acc->y_pin = -1;
+	traceCount = readTraceCount();
+	tracePos = 0;
+	traceRun = 0;
+	acc->getDirection = getReplayDirection;
+	acc->getDetailedDirection = getDetailedDirection;
+	return acc;
+}
+
+/*
+.____    .__        __    
+|    |   |__| ____ |  | __
+|    |   |  |/    \|  |/ /
+|    |___|  |   |  \    < 
+|_______ \__|___|  /__|_ \
+        \/       \/     \/
+*/
+unsigned int linkCRC(unsigned int crc, unsigned char data) {
+	int i;
+	crc ^= (unsigned int)data << 8;
+	for (i = 0; i < 8; i++) {
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
+static int receiveByte() {
+	int c = USART_Poll();
+	if (c >= 0) return c;
+	unsigned int deadline = readTimer() + MS_TO_TICKS(LINK_TIMEOUT_MS);
+	while ((c = USART_Poll()) < 0) {
+		if (ticksUntil(deadline) <= 0) return -1;
+	}
+	return c;
+}
+
+static void sendFrame(unsigned char cmd, unsigned int addr, unsigned char* data, unsigned char len) {
+	unsigned char header[4];
+	unsigned int crc = 0xFFFF;
+	int i;
+	header[0] = cmd;
+	header[1] = addr & 0xFF;
+	header[2] = addr >> 8;
+	header[3] = len;
+	USART_Transmit(LINK_SOH);
+	for (i = 0; i < 4; i++) {
+		crc = linkCRC(crc, header[i]);
+		USART_Transmit(header[i]);
+	}
+	for (i = 0; i < len; i++) {
+		crc = linkCRC(crc, data[i]);
+		USART_Transmit(data[i]);
+	}
+	USART_Transmit(crc & 0xFF);
+	USART_Transmit(crc >> 8);
+}
+
+/* Receives a frame into frame: command, address, length, data and CRC (without SOH).
+   Returns the command, 0 for a damaged frame and -1 when nothing was received */
+static int receiveFrame(unsigned char* frame) {
+	// At 1M baud a byte arrives every 160 cycles, so we only store the bytes and check the CRC afterwards
+	unsigned int crc = 0xFFFF;
+	int c, i;
+	int size = 4;
+	do {
+		c = receiveByte();
+		if (c < 0) return -1;
+	} while (c != LINK_SOH);
+	// The host repeats SOH to start a session, skip the extra ones
+	do {
+		c = receiveByte();
+	} while (c == LINK_SOH);
+	for (i = 0; i < size; i++) {
+		if (c < 0) return 0;
+		frame[i] = c;
+		if (i == 3) {
+			if (c > LINK_BLOCK) return 0;
+			size = 4 + c + 2;
+		}
+		if (i + 1 < size) c = receiveByte();
+	}
+	for (i = 0; i < size - 2; i++) {
+		crc = linkCRC(crc, frame[i]);
+	}
+	if ((frame[size - 2] | (frame[size - 1] << 8)) != crc) return 0;
+	return frame[0];
+}
+
+void linkSession(unsigned char* memory, unsigned int size) {
+	// One buffer for the request and the answer, SRAM is tight
+	unsigned char frame[4 + LINK_BLOCK + 2];
+	unsigned char* data = frame + 4;
+	int idle = 0;
+	int i;
+	sendFrame(LINK_ACK, 0, 0, 0);
+	while (idle < LINK_IDLE) {
+		int cmd = receiveFrame(frame);
+		if (cmd < 0) {
+			idle++;
+			continue;
+		}
+		idle = 0;
+		unsigned int addr = frame[1] | (frame[2] << 8);
+		unsigned char len = frame[3];
+		// Read requests ask for data[0] bytes
+		unsigned char count = (len == 1 && data[0] <= LINK_BLOCK) ? data[0] : 0;
+		switch (cmd) {
+			case LINK_PING:
+				sendFrame(LINK_ACK, addr, 0, 0);
+				break;
+			case LINK_INFO:
+				data[0] = size & 0xFF;
+				data[1] = size >> 8;
+				sendFrame(LINK_DATA, 0, data, 2);
+				break;
+			case LINK_SPEED: {
+				unsigned long baud = data[0] | ((unsigned int)data[1] << 8) | ((unsigned long)data[2] << 16) | ((unsigned long)data[3] << 24);
+				unsigned int ubrr;
+				int error = (len == 4) ? USART_BaudError(baud, &ubrr) : -1;
+				if (error < 0 || error > USART_MAX_ERROR) {
+					sendFrame(LINK_NAK, addr, 0, 0);
+				} else {
+					sendFrame(LINK_ACK, addr, 0, 0);
+					USART_SetSpeed(baud);
+				}
+				break;
+			}
+			case LINK_READ_EEPROM:
+				if (count == 0 || count > EEPROM_SIZE || addr > EEPROM_SIZE - count) {
+					sendFrame(LINK_NAK, addr, 0, 0);
+					break;
+				}
+				for (i = 0; i < count; i++) {
+					data[i] = EEPROM_read(addr + i);
+				}
+				sendFrame(LINK_DATA, addr, data, count);
+				break;
+			case LINK_WRITE_EEPROM:
+				if (len > EEPROM_SIZE || addr > EEPROM_SIZE - len) {
+					sendFrame(LINK_NAK, addr, 0, 0);
+					break;
+				}
+				// A write takes 3.3ms, skip the bytes that are already right
+				for (i = 0; i < len; i++) {
+					if (EEPROM_read(addr + i) != data[i]) EEPROM_write(addr + i, data[i]);
+				}
+				sendFrame(LINK_ACK, addr, 0, 0);
+				break;
+			case LINK_READ_MEMORY:
+				if (count == 0 || count > size || addr > size - count) {
+					sendFrame(LINK_NAK, addr, 0, 0);
+					break;
+				}
+				sendFrame(LINK_DATA, addr, memory + addr, count);
+				break;
+			case LINK_WRITE_MEMORY:
+				if (len > size || addr > size - len) {
+					sendFrame(LINK_NAK, addr, 0, 0);
+					break;
+				}
+				for (i = 0; i < len; i++) {
+					memory[addr + i] = data[i];
+				}
+				sendFrame(LINK_ACK, addr, 0, 0);
+				break;
+			case LINK_END:
+				sendFrame(LINK_ACK, addr, 0, 0);
+				idle = LINK_IDLE;
+				break;
+			default:
+				sendFrame(LINK_NAK, addr, 0, 0);
+				break;
+		}
+	}
+	// Back to the normal speed and frame format
+	USART_Flush();
+	UCSR0A = 0;
+	USART_Init(MYUBRR);
+}
@@ -32,6 +32,16 @@
 
 #include <inttypes.h>
 
+// Constant tables are kept in program memory on the board, SRAM is tight. The host tools share
+// these sources, there they are ordinary constants.
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte(address) (*(address))
+#define pgm_read_word(address) (*(address))
+#endif
+
 typedef volatile unsigned char  int8;
 
 //EEPROM
@@ -42,6 +52,7 @@ typedef volatile unsigned char  int8;
 #define EEAR  (*((volatile uint16_t*)(0x41)))
 #define EEDR  (*((volatile unsigned char*)(0x40))) 
 #define AVR_S (*((volatile unsigned char*)(0x5F)))
+#define EEPROM_SIZE 512
 
 /**
 * @brief Writes to eeprom memory
@@ -99,6 +110,9 @@ void blink(int x,int pin);
 #define UCSZ00 1
 #define UCSR0A *((volatile unsigned char*)(0xC0))
 #define UDRE0  5
+#define RXC0   7
+#define U2X0   1
+#define USART_MAX_ERROR 20 // Largest accepted baud rate error, in permille
 #define UDR0   *((volatile unsigned char*)(0xC6))
 
 /**
@@ -106,8 +120,47 @@ void blink(int x,int pin);
 */
 void USART_Init( unsigned int ubrr);
 void USART_Transmit( unsigned char data);
+
+/**
+* @brief Reads a received byte without waiting
+* @return The received byte, or -1 when nothing was received
+*/
+int USART_Poll();
+
+/**
+* @brief Waits until all bytes are sent
+*/
+void USART_Flush();
+
+/**
+* @brief Computes the baud rate error of the closest divisor in double speed mode
+* @param param1 The baud rate, e.g. 250000, 500000 or 1000000
+* @param param2 Is set to the divisor (UBRR)
+* @return The error in permille, or -1 when the baud rate cannot be reached
+*/
+int USART_BaudError(unsigned long baud, unsigned int* ubrr);
+
+/**
+* @brief Switches to double speed mode (U2X) with 1 stop bit, after sending all pending bytes
+* @param param1 The baud rate
+* @return The error in permille, or -1 when the error exceeds USART_MAX_ERROR (the speed is not changed)
+*/
+int USART_SetSpeed(unsigned long baud);
+
 void printNumber(int x);
 
+/**
+* @brief Sends a number in decimal without padding, and without the stack and time that sprintf needs
+* @param param1 The number
+*/
+void printDecimal(int x);
+
+/**
+* @brief Sends an unsigned number in decimal without padding, like printDecimal
+* @param param1 The number
+*/
+void printUnsigned(unsigned int x);
+
 //ADC
 #define ADMUX  *((volatile unsigned char*)(0x7C))
 #define ADCSRA *((volatile unsigned char*)(0x7A))
@@ -131,6 +184,67 @@ void printNumber(int x);
 void initAnalog();
 unsigned char readAnalog(unsigned char x);
 
+//Timer1
+#define TCCR1A *((volatile unsigned char*)(0x80))
+#define TCCR1B *((volatile unsigned char*)(0x81))
+#define TCNT1  *((volatile uint16_t*)(0x84))
+#define CS12   2
+#define OCR1A  *((volatile uint16_t*)(0x88))
+#define TIMSK1 *((volatile unsigned char*)(0x6F))
+#define OCIE1A 1
+#define TIFR1  *((volatile unsigned char*)(0x36))
+#define OCF1A  1
+#define SMCR   *((volatile unsigned char*)(0x53))
+#define SE     0 // sleep enable, the sleep mode bits stay 0 (idle)
+#define TIMER1_COMPA_vect __vector_11
+#define TICK_US 16 // Duration of one timer tick in microseconds (16MHz / 256)
+#define MS_TO_TICKS(ms) ((unsigned int)((ms) * 1000UL / TICK_US))
+
+/**
+* @brief Starts timer 1 as a free running counter with a prescale of 256
+*/
+void initTimer();
+
+/**
+* @brief Reads the free running timer
+* @return The current time in ticks of TICK_US, wraps around roughly every second
+*/
+unsigned int readTimer();
+
+/**
+* @brief Number of ticks left until a deadline
+* @param param1 The deadline, a value of readTimer less than half a second in the future
+* @return The ticks left, zero or negative when the deadline has passed
+*/
+int ticksUntil(unsigned int deadline);
+
+/**
+* @brief Waits until the timer reaches a deadline
+*/
+void waitUntil(unsigned int deadline);
+
+/**
+* @brief Sleeps in idle mode until the timer reaches a deadline, a compare match of timer 1 wakes the CPU up.
+* The timers, the USART and the SPI keep running while the CPU sleeps.
+* @param param1 The deadline, a value of readTimer less than half a second in the future
+*/
+void sleepUntil(unsigned int deadline);
+
+//Stack
+#define SP     *((volatile uint16_t*)(0x5D))
+#define STACK_PAINT 0xC5
+
+/**
+* @brief Fills the free SRAM between the heap and the stack with STACK_PAINT.
+* Call it once all memory is allocated, unusedStack then tells how deep the stack has grown since.
+*/
+void paintStack();
+
+/**
+* @brief Number of bytes above the heap that the stack has not reached since paintStack
+*/
+unsigned int unusedStack();
+
 //Pin configurations for the display
 #define SCK_P  1
 #define CS     2
@@ -156,6 +270,12 @@ void initDisplay();
 void fillRectangle(int x, int y, int width, int height, int color);
 void clearScreen();
 
+/**
+* @brief Counts the 9 bit words sent to the display
+* @return The number of words sent since startup, wraps around
+*/
+unsigned int readSPICount();
+
 
 #define SCREEN_WIDTH 131
 #define SCREEN_HEIGHT 131
@@ -168,17 +288,31 @@ int readPulse(int pin);
 
 #define sendMessage(s,methodName,...) s->methodName(s, ##__VA_ARGS__)
 
+#define MAX_BALLS 8
+#define NOT_DRAWN -1000
+
 typedef struct ball {
 	int x_pos;
 	int y_pos;
 	int width;
 	int height;
 	int color;
-	void(*move)(struct ball*,int x, int y);
+	int drawn_x; // position where the ball is on the screen, NOT_DRAWN if it is not
+	int drawn_y;
+	void(*move)(struct ball*,int x, int y);  // moves and redraws immediately
+	void(*place)(struct ball*,int x, int y); // only moves, the ball is redrawn by renderBalls
 } Ball;
 
 Ball* createBall(int x, int y,int w,int h);
 
+/**
+* @brief Redraws all placed balls in a single pass: first all old positions are erased, then the balls
+* are drawn at their new positions. Balls that did not move are only redrawn when an erased area overlaps them.
+* @param param1 The balls to render
+* @param param2 The number of balls, at most MAX_BALLS
+*/
+void renderBalls(Ball* balls[], int count);
+
 
 typedef enum { LEFT,RIGHT,DOWN,UP,NEUTRAL } direction; 
 
@@ -191,4 +325,83 @@ typedef struct  acc {
 
 Accelerometer* newAccelerometer();
 
+//Trace
+// The EEPROM holds a header (random seed and number of records, both 16 bit little endian)
+// followed by one byte per record: the direction in the upper 3 bits and the number of
+// consecutive steps with that direction in the lower 5 bits.
+#define TRACE_HEADER  4
+#define TRACE_SIZE    EEPROM_SIZE
+#define TRACE_MAX_RUN 31
+
+typedef enum { TRACE_OFF, TRACE_RECORD, TRACE_REPLAY, TRACE_DUMP } traceMode;
+
+/**
+* @brief Erases the trace in eeprom and starts a new recording
+* @param param1 The seed of the random generator, stored so a replay can reuse it
+*/
+void traceStart(unsigned int seed);
+
+/**
+* @brief Records the direction of one step, runs of equal directions are buffered.
+* A buffered run only reaches the eeprom on a change of direction, a full run or traceFlush,
+* so call traceFlush regularly or the last steps are missing from the replay.
+* @param param1 The direction read from the accelerometer
+*/
+void traceRecord(direction d);
+
+/**
+* @brief Writes the buffered run to eeprom, does nothing when the eeprom is full
+*/
+void traceFlush();
+
+/**
+* @brief Reads the random seed that was stored with the trace
+*/
+unsigned int traceSeed();
+
+/**
+* @brief Sends the header and all records of the trace over the USART
+*/
+void traceDump();
+
+/**
+* @brief Creates an accelerometer that replays the trace stored in eeprom,
+* once the trace is exhausted it keeps returning NEUTRAL
+*/
+Accelerometer* newReplayAccelerometer();
+
+//Link
+// Block transfers over the USART. A frame is SOH, command, address (16 bit), length, length data bytes
+// and a CRC-16 (CCITT, little endian) over everything after SOH. The host sends a request and the board
+// answers with an ACK, a DATA frame or a NAK. On a NAK, a CRC error or a timeout the host sends the request again.
+// Read requests carry one data byte: the number of bytes to read.
+#define LINK_SOH     0x01
+#define LINK_BLOCK   16 // the frame buffer of a session is on the stack of the loop
+#define LINK_ACK     'A'
+#define LINK_NAK     'N'
+#define LINK_DATA    'D'
+#define LINK_PING    'P'
+#define LINK_INFO    'I' // answers the size of the memory region (16 bit)
+#define LINK_SPEED   'S' // data: the new baud rate (32 bit), the board answers at the old speed and then switches
+#define LINK_END     'X'
+#define LINK_READ_EEPROM  'e'
+#define LINK_WRITE_EEPROM 'E'
+#define LINK_READ_MEMORY  'm'
+#define LINK_WRITE_MEMORY 'M'
+#define LINK_TIMEOUT_MS 400
+#define LINK_IDLE     5  // number of timeouts after which the session ends
+
+/**
+* @brief Updates a CRC-16 (CCITT, polynomial 0x1021, start value 0xFFFF) with one byte
+*/
+unsigned int linkCRC(unsigned int crc, unsigned char data);
+
+/**
+* @brief Serves block transfers until the host ends the session or stays silent, then returns to BAUD.
+* Call it when a LINK_SOH byte was received.
+* @param param1 Memory that the host can read and write, e.g. the values of the learner
+* @param param2 The size of that memory
+*/
+void linkSession(unsigned char* memory, unsigned int size);
+
 #endif
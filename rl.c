@@ -0,0 +1,457 @@
+/*
+    This software library provides a naive implementation for the various
+    components of the ATMEGA168p microcontroller. 
+    It is not recomended to use this library for production purposes. 
+
+    Copyright (C) 2014 Christophe Scholliers (Software Languages Lab VUB)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "rl.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+* Due to severe memory restrictions (only 1024 kb memory), we cannot simple create and state-action table for
+* every possible combination (e.g., a 13x13x5 array = 3380). We realise that the problem is a symmetrical one, and divide
+* the board in to 4 quadrants: A, B, C, and D (see drawing).
+* 
+* Given the true x_pos and y_pos of the ball (range [0,121]), we convert this to a x and y ([0,6]) to indicate the state.
+* 
+* For every state the ball is in, the reinforcement learner has to choose one of 3 actions:
+* 	Neutral (stay in position),
+* 	Away from X-axis,
+* 	Away from Y-axis
+* 
+* Actions to move away from the axis are dependant on the quadrant that the ball is in. 
+* Moving away from X-axis is the same in quadrants A and B, but mirrored in quadrants C and D.
+* Moving away from Y-axis is the same in quadrants A and C, but mirrored in quadrants B and D.
+* 
+* Example:
+* The ball is in position (110,30) thus the state is (1,3). We expect the optimal action to be to move away from
+* the Y-axis. Because we are in quadrant B, moving away from the Y-axis means reducing the x_pos of the ball.
+* Reducing the x_pos of the ball is equal to direction RIGHT (see function moveBall).
+* 
+*    0  1  2  3  4  5  6  5  4  3  2  1  0 
+* 0 +------------------+-----------------+
+* 1 |                  |                 |
+* 2 |                  |                 |
+* 3 |        A         |        B     o  | // the o is the example ball position
+* 4 |                  |                 |
+* 5 |                  |                 |
+* 6 +------------------------------------+
+* 5 |                  |                 |
+* 4 |                  |                 |
+* 3 |        C         |        D        |
+* 2 |                  |                 |
+* 1 |                  |                 |
+* 0 +------------------+-----------------+
+*
+*/ 
+
+static const signed char START_OFFSETS[MAX_BALLS][2] PROGMEM = { {0,0}, {-30,-30}, {30,30}, {-30,30}, {30,-30}, {-30,0}, {30,0}, {0,-30} };
+
+int startOffset(int ball, int axis){
+	return (signed char) pgm_read_byte(&START_OFFSETS[ball][axis]);
+}
+
+/* Moves the ball in a given direction for a given stepsize, it is redrawn by the next renderBalls */
+void moveBall(Ball *b, direction d, int step){
+	switch(d) {
+		case LEFT:  sendMessage(b, place, b->x_pos+step, b->y_pos); break;
+		case RIGHT: sendMessage(b, place, b->x_pos-step, b->y_pos); break;
+		case DOWN:  sendMessage(b, place, b->x_pos, b->y_pos-step); break;
+		case UP:    sendMessage(b, place, b->x_pos, b->y_pos+step); break;
+		default: break;
+	}
+}
+
+/* Converts the true position of the ball to a state (x,y), in a manner as described above */
+void getState(Ball *b, int *x, int *y){
+	getPositionState(b->x_pos, b->y_pos, x, y);
+}
+
+void getPositionState(int x_pos, int y_pos, int *x, int *y){
+	// The position of the ball is given by x,y coordinates in [0,131],
+	// However the ball is 10 pixels, so it will only move in a range of [0, 121] (because the screen is bounded)
+	
+	// The first step is to convert this to a [0,12] range		
+	*x = x_pos / 10;
+	*y = y_pos / 10;
+	
+	// Sanity checks (TODO: check if sanity checks can be omitted)		
+	if (*x < 0)  *x = 0;
+	if (*x > 12) *x = 12;
+	if (*y < 0)  *y = 0;
+	if (*y > 12) *y = 12;
+	
+	// Map x,y to conform with the drawing (see in comments up) by counting as 0,1,..,5,6,5,..1,0 
+	*x = (*x > 6) ? (12 - *x) : *x; 
+	*y = (*y > 6) ? (12 - *y) : *y;
+}
+
+/** 
+ * Follows the epsilon-greedy action selection method: 
+ * With a probability of 1-epsilon, it will choose the action with the highest Q-value (= the optimal action).
+ * With a probability of epsilon, it will choose a random action
+ * ==> This shows the trade-off that Q-learning has to make between exploitation and exploration
+ *
+ * NB: we return here the INDEX of the optimal action. The actual ACTION is dependent of the quadrant of the ball.
+ *
+ */
+int selectActionIndex(float qvalues[], int epsilon){
+	int action_idx;
+	if ((rand() % 101) < epsilon){ // Choose a random action with a probability of epsilon
+		action_idx = rand() % NUM_ACTIONS;
+	} else { // Choose the best action (= max Q-value) with probability 1-epsilon
+		// We try to select the action index with the highest Q-value.
+		// By starting with action_idx = 0, and using > (instead of >=), we bias towards the 0 action (neutral)
+		action_idx = 0;
+		int i;
+		for (i = 1; i < NUM_ACTIONS; i++) {
+			if (qvalues[i] > qvalues[action_idx]) {
+				action_idx = i;
+			}
+		}
+	}
+	return action_idx;
+}
+
+/**
+ * Returns an action for the given action_idx, based on the position of the ball.
+ * Remember that the action_idx stands for: neutral, move away from x-axis, move away from y-axis.
+ * And remember that "moving away from an axis" is dependent on which quadrant the ball is positioned. 
+ */
+direction getAction(Ball *b, int action_idx){
+	direction action = NEUTRAL;
+	// Map the action_idx to an action asif we are in the quadrant A:
+	switch(action_idx){
+		case 0: action = NEUTRAL; break; // stay in position
+		case 1: action = LEFT;	  break; // move away from x-axis
+		case 2: action = UP; 	  break; // move away from y-axis
+	}
+	// Check if we are in quadrant B / D
+	if (b->x_pos > 61 && action == LEFT){
+		action = RIGHT;
+	}
+	// Check if we are in quadrant C / D
+	if (b->y_pos > 61 && action == UP){
+		action = DOWN;
+	}
+	
+	return action;
+}
+
+/**
+ * Returns a reward for the given state of the ball, making the center of the screen the goal state (+10),
+ * the bounds of the screen very bad (-100), and every other area -1.
+ * The reward structure is open for interpretation and can be toyed with to achieve different goals.
+ *
+ * With REWARD_DISTANCE the step reward is scaled by how far the ball is away from the center,
+ * so the learner is also pushed towards the center before it ever reaches it.
+ */
+int getReward(const Rewards *r, int x, int y){
+	// The rewards of the board are constants in program memory
+	int step = pgm_read_word(&r->step);
+	int reward = step;
+	if (pgm_read_word(&r->shape) == REWARD_DISTANCE){
+		reward = step * (6 - ((x < y) ? x : y));
+	}
+	if (x == 6 && y == 6){
+		reward = pgm_read_word(&r->goal);
+	} else if (x == 0  || y == 0 || x == 12 || y == 12) {
+   		reward = pgm_read_word(&r->edge);
+   	}
+	return reward;
+}
+
+/* Q-learning update rule for taking action_idx in state (x,y), ending up in state (new_x,new_y) */
+float updateQValue(QTable qvalues, int x, int y, int action_idx, int reward, int new_x, int new_y, float alpha, float gamma){
+	// Get the best action index for our new state. Note that we use epsilon = 0 here, because
+	// we want te best possible action without exploration (part of the update rule, see theory)
+	int new_action_idx = selectActionIndex(qvalues[new_x][new_y], 0);
+	float error = reward + gamma * qvalues[new_x][new_y][new_action_idx] - qvalues[x][y][action_idx];
+	qvalues[x][y][action_idx] += alpha * error;
+	return error;
+}
+
+// ADT Learner: Q-table
+int selectTableAction(Learner *self, int x_pos, int y_pos, int epsilon){
+	int x, y;
+	getPositionState(x_pos, y_pos, &x, &y);
+	return selectActionIndex(((float (*)[NUM_STATES][NUM_ACTIONS]) self->values)[x][y], epsilon);
+}
+
+int updateTable(Learner *self, int x_pos, int y_pos, int action_idx, int reward, int new_x_pos, int new_y_pos, int alpha){
+	int x, y, new_x, new_y;
+	getPositionState(x_pos, y_pos, &x, &y);
+	getPositionState(new_x_pos, new_y_pos, &new_x, &new_y);
+	float error = updateQValue(self->values, x, y, action_idx, reward, new_x, new_y, alpha * (1.0f / (1 << ALPHA_FRAC)), self->gamma);
+	// Clamped like the tile coder, the error can exceed an int once it has WEIGHT_FRAC fractional bits
+	error *= (1 << WEIGHT_FRAC);
+	if (error > INT16_MAX) return INT16_MAX;
+	if (error < INT16_MIN) return INT16_MIN;
+	return error;
+}
+
+Learner* newQTable(float gamma){
+	Learner* q = (Learner*) malloc(sizeof(Learner));
+	if (q == NULL) return NULL;
+	q->values = calloc(1, sizeof(QTable));
+	if (q->values == NULL) {
+		free(q);
+		return NULL;
+	}
+	q->selectAction = selectTableAction;
+	q->update = updateTable;
+	q->gamma = gamma;
+	q->size = sizeof(QTable);
+	return q;
+}
+
+/**
+ * ADT Learner: tile coding
+ *
+ * The Q-table only knows 7x7 states of 10 pixels. The tile coder looks at the position itself: every tiling
+ * is a grid of TILE_SIZE pixels, shifted a bit with respect to the other tilings. The position falls in one tile
+ * of every tiling, and the Q-value of an action is the sum of the weights of those tiles. Nearby positions
+ * share most of their tiles, so they generalize, while positions that are 4 pixels apart can still differ.
+ *
+ * Like the table, we fold the screen into quadrant A, so the action indices keep their meaning.
+ * An update only uses integer arithmetic, alpha comes in with ALPHA_FRAC fractional bits.
+ */
+#define DELTA_SHIFT (ALPHA_FRAC + 2) // removes the fractional bits of alpha and divides by NUM_TILINGS
+
+static int foldPosition(int pos){
+	if (pos < 0) pos = 0;
+	if (pos > SCREEN_WIDTH - 10) pos = SCREEN_WIDTH - 10;
+	return (pos > 60) ? (SCREEN_WIDTH - 10 - pos) : pos;
+}
+
+/* Index of the weight of the tile that contains the folded position (fx,fy) in the given tiling */
+static int tileIndex(int tiling, int fx, int fy, int action_idx){
+	// Offsets of (1,3) x TILE_SIZE / NUM_TILINGS, so the tilings are not all shifted along the diagonal
+	int tx = (fx + tiling * (TILE_SIZE / NUM_TILINGS)) / TILE_SIZE;
+	int ty = (fy + (tiling * 3 * (TILE_SIZE / NUM_TILINGS)) % TILE_SIZE) / TILE_SIZE;
+	unsigned int code = ((tiling * TILES_PER_ROW + tx) * TILES_PER_ROW + ty) * NUM_ACTIONS + action_idx;
+	return (code * 157u) % TILE_WEIGHTS;
+}
+
+static long tileValue(Tiles *t, int fx, int fy, int action_idx){
+	long value = 0;
+	int tiling;
+	for (tiling = 0; tiling < NUM_TILINGS; tiling++) {
+		value += t->weights[tileIndex(tiling, fx, fy, action_idx)];
+	}
+	return value;
+}
+
+static int greedyTileAction(Tiles *t, int fx, int fy, long *best){
+	int action_idx = 0;
+	int i;
+	*best = tileValue(t, fx, fy, 0);
+	for (i = 1; i < NUM_ACTIONS; i++) {
+		long value = tileValue(t, fx, fy, i);
+		if (value > *best) {
+			*best = value;
+			action_idx = i;
+		}
+	}
+	return action_idx;
+}
+
+int selectTileAction(Learner *self, int x_pos, int y_pos, int epsilon){
+	// Same epsilon-greedy selection as selectActionIndex
+	if ((rand() % 101) < epsilon){
+		return rand() % NUM_ACTIONS;
+	}
+	long best;
+	return greedyTileAction(self->values, foldPosition(x_pos), foldPosition(y_pos), &best);
+}
+
+int updateTiles(Learner *self, int x_pos, int y_pos, int action_idx, int reward, int new_x_pos, int new_y_pos, int alpha){
+	Tiles *t = self->values;
+	int fx = foldPosition(x_pos);
+	int fy = foldPosition(y_pos);
+	long next;
+	greedyTileAction(t, foldPosition(new_x_pos), foldPosition(new_y_pos), &next);
+	long error = (long) reward * (1 << WEIGHT_FRAC) + ((next * t->gamma) >> 8) - tileValue(t, fx, fy, action_idx);
+	// Every tiling gets its share of alpha * error: remove the 8 fractional bits of alpha and divide by
+	// the number of tilings with a single (rounding) shift
+	long delta = (error * alpha + (1L << (DELTA_SHIFT - 1))) >> DELTA_SHIFT;
+	int tiling;
+	for (tiling = 0; tiling < NUM_TILINGS; tiling++) {
+		int16_t *w = &t->weights[tileIndex(tiling, fx, fy, action_idx)];
+		long value = *w + delta;
+		if (value > INT16_MAX) value = INT16_MAX;
+		if (value < INT16_MIN) value = INT16_MIN;
+		*w = value;
+	}
+	if (error > INT16_MAX) return INT16_MAX;
+	if (error < INT16_MIN) return INT16_MIN;
+	return error;
+}
+
+Learner* newTileCoder(float gamma){
+	Learner* q = (Learner*) malloc(sizeof(Learner));
+	if (q == NULL) return NULL;
+	Tiles* t = (Tiles*) calloc(1, sizeof(Tiles));
+	if (t == NULL) {
+		free(q);
+		return NULL;
+	}
+	t->gamma = gamma * 256;
+	q->selectAction = selectTileAction;
+	q->update = updateTiles;
+	q->gamma = gamma;
+	q->values = t;
+	q->size = sizeof(Tiles);
+	return q;
+}
+
+/**
+ * Schedules: a fixed epsilon keeps paying for random actions, and a fixed alpha for updates, long after the policy
+ * has settled. Instead we count the visits of every state: a state that was visited often explores less and learns
+ * slower. When the TD errors are small and the greedy policy stops changing, the learner is converged: it acts
+ * greedily and stops updating. It keeps an eye on the TD error though, and starts learning again when it rises.
+ */
+void initSchedule(Schedule *s, int enabled, float threshold){
+	int x, y;
+	s->enabled = enabled;
+	s->converged = 0;
+	s->checks = 0;
+	for (x = 0; x < NUM_STATES; x++) {
+		for (y = 0; y < NUM_STATES; y++) {
+			s->visits[x][y] = 0;
+		}
+	}
+	s->threshold = threshold * (1 << WEIGHT_FRAC);
+	s->error = 0;
+	s->stable = 0;
+}
+
+int scheduleSelect(Schedule *s, Learner *q, int x_pos, int y_pos, int epsilon){
+	if (s->enabled) {
+		int x, y;
+		getPositionState(x_pos, y_pos, &x, &y);
+		epsilon = s->converged ? 0 : epsilon * VISIT_DECAY / (VISIT_DECAY + s->visits[x][y]);
+	}
+	return sendMessage(q, selectAction, x_pos, y_pos, epsilon);
+}
+
+static void trackError(Schedule *s, int error){
+	if (error < 0) error = (error < -INT16_MAX) ? INT16_MAX : -error;
+	// Round the step, a plain shift would ignore small rises but not small falls and the average would run low.
+	// In long: with a clamped error and a small average the sum does not fit in a 16 bit int
+	s->error += ((long) error - s->error + (1 << (ERROR_SHIFT - 1))) >> ERROR_SHIFT;
+}
+
+int scheduleLearn(Schedule *s, Learner *q, int x_pos, int y_pos, int action_idx, int reward, int new_x_pos, int new_y_pos, int alpha){
+	if (!s->enabled) {
+		sendMessage(q, update, x_pos, y_pos, action_idx, reward, new_x_pos, new_y_pos, alpha);
+		return 1;
+	}
+	if (s->converged) {
+		// Fast path: no update, only an occasional look at the TD error (alpha = 0 leaves the learner untouched)
+		if (++s->checks < CHECK_STEPS) return 0;
+		s->checks = 0;
+		trackError(s, sendMessage(q, update, x_pos, y_pos, action_idx, reward, new_x_pos, new_y_pos, 0));
+		if (s->error > 2 * s->threshold) {
+			s->converged = 0;
+			s->stable = 0;
+		}
+		return 0;
+	}
+	int x, y;
+	getPositionState(x_pos, y_pos, &x, &y);
+	int greedy = sendMessage(q, selectAction, x_pos, y_pos, 0);
+	int visits = s->visits[x][y];
+	// Fixed point, like alpha itself: no floating point math on the way to the learner
+	int decayed = alpha * VISIT_DECAY / (VISIT_DECAY + visits);
+	if (decayed < alpha / ALPHA_FLOOR) decayed = alpha / ALPHA_FLOOR;
+	trackError(s, sendMessage(q, update, x_pos, y_pos, action_idx, reward, new_x_pos, new_y_pos, decayed));
+	if (visits < 255) s->visits[x][y] = visits + 1;
+	if (greedy != sendMessage(q, selectAction, x_pos, y_pos, 0)) {
+		s->stable = 0;
+	} else if (s->stable < STABLE_STEPS) {
+		s->stable++;
+	}
+	if (s->stable >= STABLE_STEPS && s->error < s->threshold) {
+		s->converged = 1;
+		s->checks = 0;
+	}
+	return 1;
+}
+
+/**
+ * Dyna-Q: besides learning from the real step, we replay steps we have seen before through the same update rule.
+ * The board spends most of a step waiting anyway, so these simulated updates come for free and spread
+ * a reward much faster over the states that lead to it.
+ *
+ * The agent moves deterministically: an action takes the ball a fixed step away from an axis. So the model only
+ * remembers one starting point for every (folded) state and action, and replays the action from there. That covers
+ * every state the ball has visited, instead of only the last few steps. The starting point is kept as the offset
+ * within the 10x10 pixels of the state and replayed in quadrant A, everything is folded into it anyway.
+ * Rewards are recomputed with the current reward function.
+ */
+
+/* Offset of a position within its (folded) state, in quadrant A */
+static int stateOffset(int pos, int state){
+	if (pos / 10 <= 6) return pos % 10;
+	// Mirrored: take the offset of the position the tile coder sees. The states are mirrored around 65 and
+	// foldPosition around 60, so the offset can fall outside the state and is clamped (at most 8 pixels off)
+	int offset = foldPosition(pos) - 10 * state;
+	if (offset < 0) offset = 0;
+	if (offset > 9) offset = 9;
+	return offset;
+}
+
+void rememberTransition(Model *m, int x_pos, int y_pos, int action_idx, int new_x_pos, int new_y_pos){
+	int x, y;
+	int moved = abs(new_x_pos - x_pos) + abs(new_y_pos - y_pos);
+	if (x_pos < 0 || y_pos < 0) return;
+	if (moved > 0 && moved < 256) m->step = moved;
+	getPositionState(x_pos, y_pos, &x, &y);
+	unsigned char *entry = &m->from[x][y][action_idx];
+	if (*entry == 0) m->count++;
+	*entry = 1 + 10 * stateOffset(x_pos, x) + stateOffset(y_pos, y);
+}
+
+int planQValue(Learner *q, Model *m, const Rewards *r, int alpha){
+	if (m->count == 0) return 0;
+	// Start at a random entry and take the first known one from there
+	int i = rand() % (NUM_STATES * NUM_STATES * NUM_ACTIONS);
+	unsigned char *entries = &m->from[0][0][0];
+	while (entries[i] == 0) {
+		i = (i + 1) % (NUM_STATES * NUM_STATES * NUM_ACTIONS);
+	}
+	int action_idx = i % NUM_ACTIONS;
+	int x_pos = i / (NUM_STATES * NUM_ACTIONS) * 10 + (entries[i] - 1) / 10;
+	int y_pos = (i / NUM_ACTIONS) % NUM_STATES * 10 + (entries[i] - 1) % 10;
+	// The move of moveBall, on a ball without methods
+	Ball b;
+	b.x_pos = x_pos;
+	b.y_pos = y_pos;
+	switch (getAction(&b, action_idx)) {
+		case LEFT:  b.x_pos += m->step; break;
+		case RIGHT: b.x_pos -= m->step; break;
+		case DOWN:  b.y_pos -= m->step; break;
+		case UP:    b.y_pos += m->step; break;
+		default: break;
+	}
+	int new_x, new_y;
+	getPositionState(b.x_pos, b.y_pos, &new_x, &new_y);
+	sendMessage(q, update, x_pos, y_pos, action_idx, getReward(r, new_x, new_y), b.x_pos, b.y_pos, alpha);
+	return 1;
+}
@@ -0,0 +1,207 @@
+/*
+    This software library provides a naive implementation for the various
+    components of the ATMEGA168p microcontroller. 
+    It is not recomended to use this library for production purposes. 
+
+    Copyright (C) 2014 Christophe Scholliers (Software Languages Lab VUB)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file rl.h
+ * @brief Q-learner of the ball balancing demo. It does not touch any hardware,
+ * so it is shared between the firmware (test.c) and the host sweep tool (sweep.c).
+*/
+
+#ifndef RL_H
+#define RL_H
+
+#include "lib.h"
+
+#define NUM_STATES  7
+#define NUM_ACTIONS 3
+
+/**
+* @brief Q-values for every (folded) state and action: (7x7x3 floats) x 4 bytes = 588 bytes
+*/
+typedef float QTable[NUM_STATES][NUM_STATES][NUM_ACTIONS];
+
+/**
+* @brief Start position of a ball relative to the center of the screen, the same on the board and in the sweep tool
+* @param param1 The ball, less than MAX_BALLS
+* @param param2 0 for the x offset, 1 for the y offset
+*/
+int startOffset(int ball, int axis);
+
+typedef enum { REWARD_CENTER, REWARD_DISTANCE } rewardShape;
+
+typedef struct rewards {
+	rewardShape shape;
+	int goal;
+	int edge;
+	int step;
+} Rewards;
+
+/**
+* @brief A Q-function: either the Q-table over the folded states, or a tile coder over the positions.
+* Both take the position of the ball and use the action indices of selectActionIndex.
+* An update takes alpha with ALPHA_FRAC fractional bits and returns the TD error with WEIGHT_FRAC fractional bits,
+* with alpha = 0 it only computes the error.
+*/
+typedef struct learner {
+	int (*selectAction)(struct learner*, int x_pos, int y_pos, int epsilon);
+	int (*update)(struct learner*, int x_pos, int y_pos, int action_idx, int reward, int new_x_pos, int new_y_pos, int alpha);
+	float gamma;
+	void* values;
+	unsigned int size; // bytes of values
+} Learner;
+
+typedef enum { LEARNER_TABLE, LEARNER_TILES } learnerType;
+
+#define ALPHA_FRAC 8 // fractional bits of the learning rate of an update
+
+// Tile coding: NUM_TILINGS offset grids of TILE_SIZE pixels over the folded position of the ball.
+// The weights of all tiles and actions are hashed into TILE_WEIGHTS fixed point numbers (512 bytes)
+// with WEIGHT_FRAC fractional bits, so a weight is in the range [-512,512] and a Q-value, the sum of
+// NUM_TILINGS weights, in the range [-2048,2048].
+#define NUM_TILINGS  4
+#define TILE_SIZE    16
+#define TILE_WEIGHTS 256
+#define WEIGHT_FRAC  6
+#define TILES_PER_ROW ((60 + TILE_SIZE - 1) / TILE_SIZE + 1)
+
+typedef struct tiles {
+	int16_t weights[TILE_WEIGHTS];
+	int gamma;      // gamma with 8 fractional bits
+} Tiles;
+
+// Schedules: epsilon and alpha of a state are halved after VISIT_DECAY visits, and keep decaying
+// (alpha never below alpha / ALPHA_FLOOR). The learner counts as converged when the running average of
+// the TD error is below the threshold and no greedy action changed during STABLE_STEPS updates.
+// Once converged it only checks the TD error every CHECK_STEPS steps, and learns again above twice the threshold.
+#define VISIT_DECAY  16
+#define ALPHA_FLOOR  4
+#define STABLE_STEPS 200
+#define CHECK_STEPS  8
+#define ERROR_SHIFT  4 // the running average moves 1/16th towards every new TD error
+
+typedef struct schedule {
+	unsigned char enabled;
+	unsigned char converged;
+	unsigned char checks;                           // steps since the last check while converged
+	unsigned char visits[NUM_STATES][NUM_STATES];   // saturates at 255
+	int threshold;                                  // TD error of convergence, WEIGHT_FRAC fractional bits
+	int error;                                      // running average of the TD error, WEIGHT_FRAC fractional bits
+	unsigned int stable;                            // updates since a greedy action last changed
+} Schedule;
+
+/**
+* @brief Model of the environment for planning: for every state and action, where in the state the last real step
+* started (149 bytes). An entry is 1 + 10 * x offset + y offset within the folded state, or 0 when the action was
+* never taken there.
+* An action always moves the ball by the same step, so the model only has to remember that step.
+*/
+typedef struct model {
+	unsigned char from[NUM_STATES][NUM_STATES][NUM_ACTIONS];
+	unsigned char count; // number of known entries
+	unsigned char step;  // stepsize of the learner, taken from the real steps
+} Model;
+
+/**
+* @brief Moves the ball in a given direction for a given stepsize, without redrawing it
+*/
+void moveBall(Ball *b, direction d, int step);
+
+/**
+* @brief Converts the position of the ball to a state in [0,6]x[0,6]
+*/
+void getState(Ball *b, int *x, int *y);
+
+/**
+* @brief Converts a position on the screen to a state in [0,6]x[0,6]
+*/
+void getPositionState(int x_pos, int y_pos, int *x, int *y);
+
+/**
+* @brief Epsilon-greedy action selection
+* @param param1 The Q-values of the actions in the current state
+* @param param2 Exploration rate in %
+* @return The index of the selected action
+*/
+int selectActionIndex(float qvalues[], int epsilon);
+
+/**
+* @brief Maps an action index to a direction, based on the quadrant of the ball
+*/
+direction getAction(Ball *b, int action_idx);
+
+/**
+* @brief Reward for being in state (x,y)
+* @param param1 The rewards, in program memory (PROGMEM) on the board
+*/
+int getReward(const Rewards *r, int x, int y);
+
+/**
+* @brief Q-learning update rule
+*/
+float updateQValue(QTable qvalues, int x, int y, int action_idx, int reward, int new_x, int new_y, float alpha, float gamma);
+
+/**
+* @brief Creates a learner that uses the 7x7x3 Q-table (588 bytes)
+* @param param1 Discount factor
+* @return The learner, or NULL when there is not enough memory
+*/
+Learner* newQTable(float gamma);
+
+/**
+* @brief Creates a learner that uses tile coding with integer only updates (514 bytes)
+* @param param1 Discount factor
+* @return The learner, or NULL when there is not enough memory
+*/
+Learner* newTileCoder(float gamma);
+
+/**
+* @brief Starts a schedule, when it is not enabled epsilon and alpha stay fixed and it never converges
+* @param param1 The schedule
+* @param param2 1 to enable decaying epsilon and alpha and the convergence detector
+* @param param3 Running average of the TD error below which the learner may be converged
+*/
+void initSchedule(Schedule *s, int enabled, float threshold);
+
+/**
+* @brief Epsilon-greedy selection with the epsilon of the schedule, greedy once converged
+*/
+int scheduleSelect(Schedule *s, Learner *q, int x_pos, int y_pos, int epsilon);
+
+/**
+* @brief Updates the learner with the alpha of the schedule (alpha has ALPHA_FRAC fractional bits), and tracks convergence.
+* Once converged the learner is not updated, the TD error is only checked every CHECK_STEPS steps.
+* @return 1 when the learner was updated
+*/
+int scheduleLearn(Schedule *s, Learner *q, int x_pos, int y_pos, int action_idx, int reward, int new_x_pos, int new_y_pos, int alpha);
+
+/**
+* @brief Stores the state that a real step ended in, replacing what was known for that state and action
+*/
+void rememberTransition(Model *m, int x_pos, int y_pos, int action_idx, int new_x_pos, int new_y_pos);
+
+/**
+* @brief Dyna-Q planning: replays a random known state and action of the model through the update rule,
+* alpha has ALPHA_FRAC fractional bits
+* @return 0 when the model is still empty
+*/
+int planQValue(Learner *q, Model *m, const Rewards *r, int alpha);
+
+#endif
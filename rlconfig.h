@@ -0,0 +1,23 @@
+/*
+    Learner configuration of the ball balancing demo.
+    This file can be regenerated from the best result of a parameter sweep: ./sweep -x rlconfig.h
+*/
+#ifndef RLCONFIG_H
+#define RLCONFIG_H
+
+#define RL_ALPHA        0.1            // Learning rate
+#define RL_GAMMA        0.9            // Discount factor
+#define RL_EPSILON      15             // Exploration rate in %
+#define RL_USER_STEP    10             // Stepsize of the user (by physically moving the board)
+#define RL_AGENT_STEP   10             // Stepsize of the reinforcement learning system
+#define RL_REWARD_SHAPE REWARD_CENTER  // See rewardShape in rl.h
+#define RL_REWARD_GOAL  10             // Reward in the center of the screen
+#define RL_REWARD_EDGE  -100           // Reward on the bounds of the screen
+#define RL_REWARD_STEP  -1             // Reward everywhere else
+#define RL_PLANNING     0              // Simulated (Dyna-Q) updates per step
+#define RL_LEARNER      LEARNER_TABLE  // See learnerType in rl.h
+#define RL_BALLS        1              // Balls on the screen, each with its own agent, sharing the learner
+#define RL_ADAPTIVE     0              // Decay epsilon and alpha per state and stop learning once converged
+#define RL_CONVERGED    2.0            // Running average of the TD error below which the learner may be converged
+
+#endif
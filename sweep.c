@@ -0,0 +1,508 @@
+/*
+    Host tool that sweeps the learner parameters of the ball balancing demo.
+
+    Copyright (C) 2014 Christophe Scholliers (Software Languages Lab VUB)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file sweep.c
+ * @brief Runs the learner of rl.c against a simulated board for a grid (or a random sample)
+ * of parameters and reward shapes, with several seeds per configuration, on all cores.
+ *
+ * Every configuration is printed as a CSV line on stdout. The best configuration
+ * (highest final reward measured with the default reward function) can be exported as rlconfig.h.
+ *
+ * The tilting of the user is simulated by a random walk, or replayed from a trace
+ * recorded on the board (the raw eeprom image of TRACE_RECORD, see lib.h).
+ *
+ * Example: ./sweep -a 0.05,0.1,0.2 -g 0.8,0.9 -e 5,15 -w center,distance -n 16 -x rlconfig.h
+ */
+
+#include "rl.h"
+#include "rlconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define MAX_VALUES 16
+#define SIZE 10
+
+typedef struct config {
+	float alpha;
+	float gamma;
+	int epsilon;
+	int user_step;
+	int agent_step;
+	Rewards rewards;
+	int planning;
+	learnerType learner;
+	int balls;
+	int adaptive;
+	float converged;
+} Config;
+
+typedef struct result {
+	long converged;      // steps until the greedy policy was stable for a full window
+	long good;           // steps until the greedy policy steered the ball to the goal from nearly every state, and kept doing so
+	double reward;       // average reward over the last window, with the reward of the configuration
+	double base_reward;  // average reward over the last window, with the default reward function
+	double frozen;       // fraction of the steps that the schedule was converged
+} Result;
+
+typedef struct list {
+	double values[MAX_VALUES];
+	int count;
+} List;
+
+static const Rewards BASE_REWARDS = { REWARD_CENTER, 10, -100, -1 };
+static const char* SHAPE_NAMES[] = { "center", "distance" };
+static const char* LEARNER_NAMES[] = { "table", "tiles" };
+
+// Run parameters
+static long steps = 20000;
+static long window = 1000;
+static int persist = 80;
+static unsigned char* trace = NULL;
+static int trace_length = 0;
+
+// Parses a list of numbers, or of names when names is given (a name is stored as its index).
+// An invalid or missing value leaves the list empty.
+static void parseList(List* l, const char* s, const char** names, int num_names) {
+	char* copy = strdup(s);
+	char* tok;
+	int valid = 1;
+	l->count = 0;
+	for (tok = strtok(copy, ","); tok != NULL && valid; tok = strtok(NULL, ",")) {
+		char* end;
+		int i;
+		double v = (names == NULL) ? strtod(tok, &end) : -1;
+		if (names == NULL) {
+			valid = end != tok && *end == '\0';
+		} else {
+			for (i = 0; i < num_names; i++) {
+				if (strcmp(tok, names[i]) == 0) v = i;
+			}
+			valid = v >= 0;
+		}
+		if (l->count == MAX_VALUES) valid = 0;
+		if (valid) l->values[l->count++] = v;
+	}
+	if (!valid) l->count = 0;
+	free(copy);
+}
+
+static void setList(List* l, double v) {
+	l->values[0] = v;
+	l->count = 1;
+}
+
+static void loadTrace(const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	unsigned char header[TRACE_HEADER];
+	if (fread(header, 1, TRACE_HEADER, f) != TRACE_HEADER) {
+		fprintf(stderr, "%s: no trace header\n", path);
+		exit(1);
+	}
+	int count = header[2] | (header[3] << 8);
+	if (count > TRACE_SIZE - TRACE_HEADER) count = 0;
+	trace = malloc(count + 1);
+	trace_length = fread(trace, 1, count, f);
+	fclose(f);
+	if (trace_length == 0) {
+		fprintf(stderr, "%s: empty trace\n", path);
+		exit(1);
+	}
+	// The board never writes an empty run, and the replay would never find a step in a trace of them
+	int i;
+	for (i = 0; i < trace_length; i++) {
+		if ((trace[i] & TRACE_MAX_RUN) == 0) {
+			fprintf(stderr, "%s: record %d has no steps\n", path, i);
+			exit(1);
+		}
+	}
+}
+
+// The ball of the simulation only keeps its position, nothing is drawn
+static void simMove(Ball* self, int x, int y) {
+	self->x_pos = x;
+	self->y_pos = y;
+}
+
+typedef struct tilt {
+	direction dir;
+	int pos;
+	int run;
+} Tilt;
+
+static direction nextTilt(Tilt* t) {
+	if (trace != NULL) {
+		// Replay the recorded trace, starting over when it is exhausted
+		while (t->run == 0) {
+			unsigned char record = trace[t->pos];
+			t->pos = (t->pos + 1) % trace_length;
+			t->dir = record >> 5;
+			t->run = record & TRACE_MAX_RUN;
+		}
+		t->run--;
+		return t->dir;
+	}
+	if ((rand() % 100) >= persist) {
+		t->dir = rand() % 5;
+	}
+	return t->dir;
+}
+
+// Every GOOD_CHECK steps the greedy policy is tried without the user tilting, starting in every state of quadrant A
+// that is not at the edge. It is good when it steers the ball to the goal from GOOD_PERCENT of them.
+#define GOOD_CHECK   10
+#define GOOD_PERCENT 90
+
+static int goodPolicy(Learner* q, const Config* c) {
+	int x, y, i;
+	int reached = 0;
+	for (x = 1; x < NUM_STATES; x++) {
+		for (y = 1; y < NUM_STATES; y++) {
+			Ball b = { x * 10, y * 10, SIZE, SIZE, WHITE, NOT_DRAWN, NOT_DRAWN, simMove, simMove };
+			int sx = x, sy = y;
+			for (i = 0; i < 2 * NUM_STATES && sx > 0 && sy > 0 && !(sx == NUM_STATES - 1 && sy == NUM_STATES - 1); i++) {
+				moveBall(&b, getAction(&b, sendMessage(q, selectAction, b.x_pos, b.y_pos, 0)), c->agent_step);
+				getState(&b, &sx, &sy);
+			}
+			reached += (sx == NUM_STATES - 1 && sy == NUM_STATES - 1);
+		}
+	}
+	return reached * 100 >= GOOD_PERCENT * (NUM_STATES - 1) * (NUM_STATES - 1);
+}
+
+static void runOne(const Config* c, unsigned int seed, Result* r) {
+	Learner* q = (c->learner == LEARNER_TILES) ? newTileCoder(c->gamma) : newQTable(c->gamma);
+	if (q == NULL) {
+		perror("learner");
+		exit(1);
+	}
+	const int alpha = c->alpha * (1 << ALPHA_FRAC) + 0.5;
+	unsigned char policy[NUM_STATES][NUM_STATES];
+	const int center = (SCREEN_WIDTH/2)-SIZE/2;
+	Ball balls[MAX_BALLS];
+	Tilt t = { NEUTRAL, 0, 0 };
+	Model model;
+	Schedule schedule;
+	long frozen = 0;
+	long step;
+	long stable_since = 0;
+	long good_since = -1;
+	double reward_sum = 0;
+	double base_sum = 0;
+	int i;
+
+	for (i = 0; i < c->balls; i++) {
+		Ball b = { center + startOffset(i, 0), center + startOffset(i, 1), SIZE, SIZE, WHITE, NOT_DRAWN, NOT_DRAWN, simMove, simMove };
+		balls[i] = b;
+	}
+	memset(policy, 0, sizeof(policy));
+	memset(&model, 0, sizeof(model));
+	initSchedule(&schedule, c->adaptive, c->converged);
+	srand(seed);
+	r->converged = -1;
+
+	for (step = 0; step < steps; step++) {
+		direction d = nextTilt(&t);
+		for (i = 0; i < c->balls; i++) {
+			moveBall(&balls[i], d, c->user_step);
+		}
+		// All agents learn in the same learner, one after the other, like the firmware does
+		for (i = 0; i < c->balls; i++) {
+			Ball* b = &balls[i];
+			int x, y, new_x, new_y;
+			getState(b, &x, &y);
+			int x_pos = b->x_pos;
+			int y_pos = b->y_pos;
+			int action_idx = scheduleSelect(&schedule, q, x_pos, y_pos, c->epsilon);
+			moveBall(b, getAction(b, action_idx), c->agent_step);
+			getState(b, &new_x, &new_y);
+			int reward = getReward(&c->rewards, new_x, new_y);
+			if (scheduleLearn(&schedule, q, x_pos, y_pos, action_idx, reward, b->x_pos, b->y_pos, alpha)) {
+				rememberTransition(&model, x_pos, y_pos, action_idx, b->x_pos, b->y_pos);
+			}
+
+			// The policy is tracked in the center of every state, so a tile coder is judged on the same 7x7 grid
+			int greedy = sendMessage(q, selectAction, x * 10 + 5, y * 10 + 5, 0);
+			if (greedy != policy[x][y]) {
+				policy[x][y] = greedy;
+				stable_since = step + 1;
+			}
+			if (step >= steps - window) {
+				reward_sum += reward;
+				base_sum += getReward(&BASE_REWARDS, new_x, new_y);
+			}
+
+			if (b->y_pos > SCREEN_HEIGHT-SIZE || b->y_pos < 0 || b->x_pos > SCREEN_WIDTH-SIZE || b->x_pos < 0) {
+				simMove(b, center + startOffset(i, 0), center + startOffset(i, 1));
+			}
+		}
+		int planned;
+		frozen += schedule.converged;
+		for (planned = 0; planned < c->planning && !schedule.converged; planned++) {
+			planQValue(q, &model, &c->rewards, alpha);
+		}
+		if ((step + 1) % GOOD_CHECK == 0) {
+			if (!goodPolicy(q, c)) good_since = -1;
+			else if (good_since < 0) good_since = step + 1;
+		}
+		if (r->converged < 0 && step + 1 - stable_since >= window) {
+			r->converged = stable_since;
+		}
+	}
+	free(q->values);
+	free(q);
+	if (r->converged < 0) r->converged = steps;
+	r->good = (good_since < 0) ? steps : good_since;
+	r->reward = reward_sum / (window * c->balls);
+	r->base_reward = base_sum / (window * c->balls);
+	r->frozen = (double) frozen / steps;
+}
+
+static double pick(const List* l, int* index, int random) {
+	int i;
+	if (random) {
+		i = rand() % l->count;
+	} else {
+		i = *index % l->count;
+		*index /= l->count;
+	}
+	return l->values[i];
+}
+
+static void exportConfig(const char* path, const Config* c) {
+	FILE* f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(f, "/*\n");
+	fprintf(f, "    Learner configuration of the ball balancing demo.\n");
+	fprintf(f, "    This file can be regenerated from the best result of a parameter sweep: ./sweep -x rlconfig.h\n");
+	fprintf(f, "*/\n");
+	fprintf(f, "#ifndef RLCONFIG_H\n#define RLCONFIG_H\n\n");
+	fprintf(f, "#define RL_ALPHA        %-14g // Learning rate\n", c->alpha);
+	fprintf(f, "#define RL_GAMMA        %-14g // Discount factor\n", c->gamma);
+	fprintf(f, "#define RL_EPSILON      %-14d // Exploration rate in %%\n", c->epsilon);
+	fprintf(f, "#define RL_USER_STEP    %-14d // Stepsize of the user (by physically moving the board)\n", c->user_step);
+	fprintf(f, "#define RL_AGENT_STEP   %-14d // Stepsize of the reinforcement learning system\n", c->agent_step);
+	fprintf(f, "#define RL_REWARD_SHAPE %-14s // See rewardShape in rl.h\n",
+		c->rewards.shape == REWARD_DISTANCE ? "REWARD_DISTANCE" : "REWARD_CENTER");
+	fprintf(f, "#define RL_REWARD_GOAL  %-14d // Reward in the center of the screen\n", c->rewards.goal);
+	fprintf(f, "#define RL_REWARD_EDGE  %-14d // Reward on the bounds of the screen\n", c->rewards.edge);
+	fprintf(f, "#define RL_REWARD_STEP  %-14d // Reward everywhere else\n", c->rewards.step);
+	fprintf(f, "#define RL_PLANNING     %-14d // Simulated (Dyna-Q) updates per step\n", c->planning);
+	fprintf(f, "#define RL_LEARNER      %-14s // See learnerType in rl.h\n",
+		c->learner == LEARNER_TILES ? "LEARNER_TILES" : "LEARNER_TABLE");
+	fprintf(f, "#define RL_BALLS        %-14d // Balls on the screen, each with its own agent, sharing the learner\n", c->balls);
+	fprintf(f, "#define RL_ADAPTIVE     %-14d // Decay epsilon and alpha per state and stop learning once converged\n", c->adaptive);
+	fprintf(f, "#define RL_CONVERGED    %-14.2f // Running average of the TD error below which the learner may be converged\n", c->converged);
+	fprintf(f, "\n#endif\n");
+	fclose(f);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  lists are comma separated, e.g. -a 0.05,0.1,0.2\n"
+		"  -a list   learning rates (default %g)\n"
+		"  -g list   discount factors (default %g)\n"
+		"  -e list   exploration rates in %% (default %d)\n"
+		"  -u list   stepsizes of the user (default %d)\n"
+		"  -r list   stepsizes of the learner (default %d)\n"
+		"  -w list   reward shapes: center, distance (default center)\n"
+		"  -G list   goal rewards (default %d)\n"
+		"  -E list   edge rewards (default %d)\n"
+		"  -S list   step rewards (default %d)\n"
+		"  -P list   simulated (Dyna-Q) updates per step (default %d)\n"
+		"  -L list   learners: table, tiles (default table)\n"
+		"  -K list   balls, each with its own agent, sharing one learner (default %d)\n"
+		"  -A list   adaptive schedules and convergence detector: 0 or 1 (default %d)\n"
+		"  -C list   TD error below which the learner may be converged (default %g)\n"
+		"  -m n      random search: sample n configurations instead of the full grid\n"
+		"  -n n      seeds per configuration (default 8)\n"
+		"  -N n      steps per run (default %ld)\n"
+		"  -W n      window for convergence and final reward (default %ld)\n"
+		"  -p n      chance in %% that the simulated user keeps tilting the same way (default %d)\n"
+		"  -t file   replay a trace recorded on the board instead of simulating the user\n"
+		"  -j n      parallel jobs (default: number of cores)\n"
+		"  -x file   export the best configuration as a config header\n",
+		name, RL_ALPHA, RL_GAMMA, RL_EPSILON, RL_USER_STEP, RL_AGENT_STEP,
+		RL_REWARD_GOAL, RL_REWARD_EDGE, RL_REWARD_STEP, RL_PLANNING, RL_BALLS, RL_ADAPTIVE, RL_CONVERGED, steps, window, persist);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	List alpha, gamma, epsilon, user_step, agent_step, shape, goal, edge, step_reward, planning, learner, balls, adaptive, threshold;
+	int samples = 0;
+	int seeds = 8;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	const char* export_path = NULL;
+	int opt;
+
+	setList(&alpha, RL_ALPHA);
+	setList(&gamma, RL_GAMMA);
+	setList(&epsilon, RL_EPSILON);
+	setList(&user_step, RL_USER_STEP);
+	setList(&agent_step, RL_AGENT_STEP);
+	setList(&shape, RL_REWARD_SHAPE);
+	setList(&goal, RL_REWARD_GOAL);
+	setList(&edge, RL_REWARD_EDGE);
+	setList(&step_reward, RL_REWARD_STEP);
+	setList(&planning, RL_PLANNING);
+	setList(&learner, RL_LEARNER);
+	setList(&balls, RL_BALLS);
+	setList(&adaptive, RL_ADAPTIVE);
+	setList(&threshold, RL_CONVERGED);
+
+	while ((opt = getopt(argc, argv, "a:g:e:u:r:w:G:E:S:P:L:K:A:C:m:n:N:W:p:t:j:x:")) != -1) {
+		switch (opt) {
+			case 'a': parseList(&alpha, optarg, NULL, 0); break;
+			case 'g': parseList(&gamma, optarg, NULL, 0); break;
+			case 'e': parseList(&epsilon, optarg, NULL, 0); break;
+			case 'u': parseList(&user_step, optarg, NULL, 0); break;
+			case 'r': parseList(&agent_step, optarg, NULL, 0); break;
+			case 'w': parseList(&shape, optarg, SHAPE_NAMES, sizeof(SHAPE_NAMES) / sizeof(SHAPE_NAMES[0])); break;
+			case 'G': parseList(&goal, optarg, NULL, 0); break;
+			case 'E': parseList(&edge, optarg, NULL, 0); break;
+			case 'S': parseList(&step_reward, optarg, NULL, 0); break;
+			case 'P': parseList(&planning, optarg, NULL, 0); break;
+			case 'L': parseList(&learner, optarg, LEARNER_NAMES, sizeof(LEARNER_NAMES) / sizeof(LEARNER_NAMES[0])); break;
+			case 'K': parseList(&balls, optarg, NULL, 0); break;
+			case 'A': parseList(&adaptive, optarg, NULL, 0); break;
+			case 'C': parseList(&threshold, optarg, NULL, 0); break;
+			case 'm': samples = atoi(optarg); break;
+			case 'n': seeds = atoi(optarg); break;
+			case 'N': steps = atol(optarg); break;
+			case 'W': window = atol(optarg); break;
+			case 'p': persist = atoi(optarg); break;
+			case 't': loadTrace(optarg); break;
+			case 'j': jobs = atoi(optarg); break;
+			case 'x': export_path = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (seeds < 1 || steps < 1 || window < 1 || window > steps || jobs < 1) usage(argv[0]);
+	List* lists[] = { &alpha, &gamma, &epsilon, &user_step, &agent_step, &shape, &goal, &edge, &step_reward, &planning, &learner, &balls, &adaptive, &threshold };
+	int num_lists = sizeof(lists) / sizeof(lists[0]);
+	int i;
+	for (i = 0; i < num_lists; i++) {
+		if (lists[i]->count == 0) usage(argv[0]);
+	}
+
+	// Build all configurations, either the full grid or a random sample of it
+	int grid = 1;
+	for (i = 0; i < num_lists; i++) grid *= lists[i]->count;
+	int count = samples > 0 ? samples : grid;
+	Config* configs = malloc(count * sizeof(Config));
+	srand(1);
+	for (i = 0; i < count; i++) {
+		int index = i;
+		int random = samples > 0;
+		Config* c = &configs[i];
+		c->alpha = pick(&alpha, &index, random);
+		c->gamma = pick(&gamma, &index, random);
+		c->epsilon = pick(&epsilon, &index, random);
+		c->user_step = pick(&user_step, &index, random);
+		c->agent_step = pick(&agent_step, &index, random);
+		c->rewards.shape = pick(&shape, &index, random);
+		c->rewards.goal = pick(&goal, &index, random);
+		c->rewards.edge = pick(&edge, &index, random);
+		c->rewards.step = pick(&step_reward, &index, random);
+		c->planning = pick(&planning, &index, random);
+		c->learner = pick(&learner, &index, random);
+		c->balls = pick(&balls, &index, random);
+		if (c->balls < 1 || c->balls > MAX_BALLS) usage(argv[0]);
+		c->adaptive = pick(&adaptive, &index, random);
+		c->converged = pick(&threshold, &index, random);
+	}
+
+	// Every (configuration, seed) pair is one run, the workers share the result array
+	int runs = count * seeds;
+	Result* results = mmap(NULL, runs * sizeof(Result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	if (jobs > runs) jobs = runs;
+	int worker;
+	for (worker = 0; worker < jobs; worker++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			int run;
+			for (run = worker; run < runs; run += jobs) {
+				runOne(&configs[run / seeds], run % seeds + 1, &results[run]);
+			}
+			_exit(0);
+		}
+	}
+	int status;
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "a worker failed\n");
+			return 1;
+		}
+	}
+
+	printf("alpha,gamma,epsilon,user_step,agent_step,shape,goal,edge,step,planning,learner,balls,adaptive,converged,seeds,steps_to_convergence,steps_to_good_policy,final_avg_reward,final_avg_base_reward,frozen\n");
+	int best = 0;
+	double best_reward = 0;
+	double best_converged = 0;
+	for (i = 0; i < count; i++) {
+		Config* c = &configs[i];
+		double converged = 0, good = 0, reward = 0, base_reward = 0, frozen = 0;
+		int s;
+		for (s = 0; s < seeds; s++) {
+			converged += results[i * seeds + s].converged;
+			good += results[i * seeds + s].good;
+			reward += results[i * seeds + s].reward;
+			base_reward += results[i * seeds + s].base_reward;
+			frozen += results[i * seeds + s].frozen;
+		}
+		converged /= seeds;
+		good /= seeds;
+		reward /= seeds;
+		base_reward /= seeds;
+		frozen /= seeds;
+		printf("%g,%g,%d,%d,%d,%s,%d,%d,%d,%d,%s,%d,%d,%g,%d,%.0f,%.0f,%.4f,%.4f,%.3f\n",
+			c->alpha, c->gamma, c->epsilon, c->user_step, c->agent_step, SHAPE_NAMES[c->rewards.shape],
+			c->rewards.goal, c->rewards.edge, c->rewards.step, c->planning, LEARNER_NAMES[c->learner], c->balls, c->adaptive, c->converged, seeds, converged, good, reward, base_reward, frozen);
+		if (i == 0 || base_reward > best_reward || (base_reward == best_reward && converged < best_converged)) {
+			best = i;
+			best_reward = base_reward;
+			best_converged = converged;
+		}
+	}
+	if (export_path != NULL) {
+		exportConfig(export_path, &configs[best]);
+		fprintf(stderr, "exported configuration %d to %s\n", best + 1, export_path);
+	}
+	return 0;
+}
@@ -19,7 +19,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "lib.h"
-#include <util/delay.h>
+#include "rl.h"
+#include "rlconfig.h"
 #include <stdio.h>
 #include <stdlib.h>	 
 	   
@@ -27,218 +28,284 @@
 static const int SIZE = 10;
 static const int X_PIN = 2;
 static const int Y_PIN = 3;
-static const int STEP  = 10; // The stepsize that the user can move the ball (by physically moving the board)
-static const int RL_STEP = 10; // The stepsize that the reinforcement learning system can move the ball
+static const int STEP  = RL_USER_STEP; // The stepsize that the user can move the ball (by physically moving the board)
+static const int RL_STEP = RL_AGENT_STEP; // The stepsize that the reinforcement learning system can move the ball
+// Number of balls on the screen, each with its own agent, see startOffset. Every ball takes 22 bytes of SRAM
+// (20 on the heap and its pointer), which leaves room for 1 ball with the Q-table and 4 with the tile coder
+static const int NUM_BALLS = RL_BALLS;
+#if RL_BALLS < 1 || RL_BALLS > MAX_BALLS
+#error "RL_BALLS must be between 1 and MAX_BALLS, there are only MAX_BALLS start offsets"
+#endif
 
-// LEARNER PARAMS
-static const float ALPHA = 0.1; // Learning rate (rate at which new training data replace previous knowledge)
-static const float GAMMA = 0.9; // Discount factor (defines relative values of the immediate vs delayed reward)
-static const int EPSILON = 15; // Exploration rate in epsilon-greedy action select (% of random action instead of optimal)
-static const int NUM_ACTIONS = 3;
+// LEARNER PARAMS (see rlconfig.h)
+static const int ALPHA = RL_ALPHA * (1 << ALPHA_FRAC) + 0.5; // Learning rate (rate at which new training data replace previous knowledge), fixed point
+static const float GAMMA = RL_GAMMA; // Discount factor (defines relative values of the immediate vs delayed reward)
+static const int EPSILON = RL_EPSILON; // Exploration rate in epsilon-greedy action select (% of random action instead of optimal)
+static const Rewards REWARDS PROGMEM = { RL_REWARD_SHAPE, RL_REWARD_GOAL, RL_REWARD_EDGE, RL_REWARD_STEP }; // in flash, see getReward
+static const int MAX_PLANNING = 200; // Upper bound of the simulated updates per step, they also have to fit in the step period
 
-/**
-* Due to severe memory restrictions (only 1024 kb memory), we cannot simple create and state-action table for
-* every possible combination (e.g., a 13x13x5 array = 3380). We realise that the problem is a symmetrical one, and divide
-* the board in to 4 quadrants: A, B, C, and D (see drawing).
-* 
-* Given the true x_pos and y_pos of the ball (range [0,121]), we convert this to a x and y ([0,6]) to indicate the state.
-* 
-* For every state the ball is in, the reinforcement learner has to choose one of 3 actions:
-* 	Neutral (stay in position),
-* 	Away from X-axis,
-* 	Away from Y-axis
-* 
-* Actions to move away from the axis are dependant on the quadrant that the ball is in. 
-* Moving away from X-axis is the same in quadrants A and B, but mirrored in quadrants C and D.
-* Moving away from Y-axis is the same in quadrants A and C, but mirrored in quadrants B and D.
-* 
-* Example:
-* The ball is in position (110,30) thus the state is (1,3). We expect the optimal action to be to move away from
-* the Y-axis. Because we are in quadrant B, moving away from the Y-axis means reducing the x_pos of the ball.
-* Reducing the x_pos of the ball is equal to direction RIGHT (see function moveBall).
-* 
-*    0  1  2  3  4  5  6  5  4  3  2  1  0 
-* 0 +------------------+-----------------+
-* 1 |                  |                 |
-* 2 |                  |                 |
-* 3 |        A         |        B     o  | // the o is the example ball position
-* 4 |                  |                 |
-* 5 |                  |                 |
-* 6 +------------------------------------+
-* 5 |                  |                 |
-* 4 |                  |                 |
-* 3 |        C         |        D        |
-* 2 |                  |                 |
-* 1 |                  |                 |
-* 0 +------------------+-----------------+
-*
-*/ 
+// MEASUREMENT PARAMS
+static const traceMode TRACE_MODE = TRACE_OFF; // Record the accelerometer input to eeprom, or replay a recorded trace
+static const int TRACE_FLUSH_STEPS = 16; // Number of steps between two writes of the buffered run, at most these steps are lost on a reset
+static const int TELEMETRY_STEPS = 16; // Number of steps between two telemetry lines on the serial port (0 = off)
 
 void initializeBoard() {
 	USART_Init(MYUBRR);
+	initTimer();
 	initDisplay();
 	clearScreen();
 }
 
 
-/* Moves the ball (and redraws) in a given direction for a given stepsize */
-void moveBall(Ball *b, direction d, int step){
-	switch(d) {
-		case LEFT:  sendMessage(b, move, b->x_pos+step, b->y_pos); break;
-		case RIGHT: sendMessage(b, move, b->x_pos-step, b->y_pos); break;
-		case DOWN:  sendMessage(b, move, b->x_pos, b->y_pos-step); break;
-		case UP:    sendMessage(b, move, b->x_pos, b->y_pos+step); break;
-		default: break;
-	}
-}
+/**
+ * The parts of a step that the time is divided in
+ */
+typedef enum { SENSING, RENDERING, LEARNING, IO, IDLE, PHASES } phase;
 
-/* Converts the true position of the ball to a state (x,y), in a manner as described above */
-void getState(Ball *b, int *x, int *y){
-	// The position of the ball is given by x,y coordinates in [0,131],
-	// However the ball is 10 pixels, so it will only move in a range of [0, 121] (because the screen is bounded)
-	
-	// The first step is to convert this to a [0,12] range		
-	*x = b->x_pos / 10;
-	*y = b->y_pos / 10;
-	
-	// Sanity checks (TODO: check if sanity checks can be omitted)		
-	if (*x < 0)  *x = 0;
-	if (*x > 12) *x = 12;
-	if (*y < 0)  *y = 0;
-	if (*y > 12) *y = 12;
-	
-	// Map x,y to conform with the drawing (see in comments up) by counting as 0,1,..,5,6,5,..1,0 
-	*x = (*x > 6) ? (12 - *x) : *x; 
-	*y = (*y > 6) ? (12 - *y) : *y;
+/**
+ * Measurements of the loop, sent over the serial port every TELEMETRY_STEPS steps
+ */
+typedef struct telemetry {
+	unsigned int steps;      // steps since startup
+	unsigned long time[PHASES]; // ticks spent in each phase, together the complete steps
+	unsigned int mark;       // end of the last accounted phase
+	unsigned int words;      // words sent to the display, see readSPICount
+	int reward;              // total reward of all balls
+	unsigned long planned;   // simulated updates
+	Schedule *schedule;      // reports the running TD error and if the learner is converged
+	int window;              // steps in the current line, -1 drops it and starts a new one at the next line
+} Telemetry;
+
+/**
+ * Charges the time since the end of the previous phase to a phase
+ */
+void account(Telemetry *t, phase p){
+	unsigned int now = readTimer();
+	t->time[p] += now - t->mark;
+	t->mark = now;
 }
 
-/** 
- * Follows the epsilon-greedy action selection method: 
- * With a probability of 1-epsilon, it will choose the action with the highest Q-value (= the optimal action).
- * With a probability of epsilon, it will choose a random action
- * ==> This shows the trade-off that Q-learning has to make between exploitation and exploration
- *
- * NB: we return here the INDEX of the optimal action. The actual ACTION is dependent of the quadrant of the ball.
- *
+/**
+ * Sends one line of telemetry, every field is a letter and a number without padding: the number of
+ * steps so far, the average time spent per step (in timer ticks, without sleeping), the average number of words sent to the display per step,
+ * the total reward collected since the previous line, the average number of simulated updates per step,
+ * the number of real transitions learned from (in tenths per second), the running average of the TD error
+ * (with WEIGHT_FRAC fractional bits) and 1 when the learner is converged and no longer updates.
+ * Then the utilization (busy time in permille of the step) and the average ticks per step spent
+ * on sensing (A), rendering (D), learning and planning (Q), the serial port (O) and sleeping (W).
+ * The idle time is the headroom left to raise the step rate or to add work.
+ * Last the bytes of SRAM that the stack has never used since startup (M), the margin left before it runs into the heap.
  */
-int selectActionIndex(float qvalues[], int epsilon){
-	int action_idx;
-	if ((rand() % 101) < EPSILON){ // Choose a random action with a probability of epsilon
-		action_idx = rand() % NUM_ACTIONS;
-	} else { // Choose the best action (= max Q-value) with probability 1-epsilon
-		// We try to select the action index with the highest Q-value.
-		// By starting with action_idx = 0, and using > (instead of >=), we bias towards the 0 action (neutral)
-		action_idx = 0;
-		int i;
-		for (i = 1; i < NUM_ACTIONS; i++) {
-			if (qvalues[i] > qvalues[action_idx]) {
-				action_idx = i;
-			}
-		}
+void sendTelemetry(Telemetry *t){
+	// About 65 bytes, at 9600 baud this takes up to 75ms: it is sent while the user looks at the move
+	unsigned long wall = 0;
+	int p;
+	for (p = 0; p < PHASES; p++) {
+		wall += t->time[p];
 	}
-	return action_idx;
+	unsigned long busy = wall - t->time[IDLE];
+	USART_Transmit('S');
+	printUnsigned(t->steps);
+	USART_Transmit('L');
+	printUnsigned(busy / TELEMETRY_STEPS);
+	USART_Transmit('B');
+	printUnsigned((readSPICount() - t->words) / TELEMETRY_STEPS);
+	USART_Transmit('R');
+	printDecimal(t->reward);
+	USART_Transmit('P');
+	printUnsigned(t->planned / TELEMETRY_STEPS);
+	USART_Transmit('T');
+	printUnsigned(NUM_BALLS * TELEMETRY_STEPS * (10000000UL / TICK_US) / wall);
+	USART_Transmit('E');
+	printDecimal(t->schedule->error);
+	USART_Transmit('C');
+	printUnsigned(t->schedule->converged);
+	USART_Transmit('U');
+	printUnsigned(busy * 1000 / wall);
+	USART_Transmit('A');
+	printUnsigned(t->time[SENSING] / TELEMETRY_STEPS);
+	USART_Transmit('D');
+	printUnsigned(t->time[RENDERING] / TELEMETRY_STEPS);
+	USART_Transmit('Q');
+	printUnsigned(t->time[LEARNING] / TELEMETRY_STEPS);
+	USART_Transmit('O');
+	printUnsigned(t->time[IO] / TELEMETRY_STEPS);
+	USART_Transmit('W');
+	printUnsigned(t->time[IDLE] / TELEMETRY_STEPS);
+	USART_Transmit('M');
+	printUnsigned(unusedStack());
+	USART_Transmit('\n');
 }
 
 /**
- * Returns an action for the given action_idx, based on the position of the ball.
- * Remember that the action_idx stands for: neutral, move away from x-axis, move away from y-axis.
- * And remember that "moving away from an axis" is dependent on which quadrant the ball is positioned. 
+ * Starts a new telemetry window at the end of the last accounted phase
  */
-direction getAction(Ball *b, int action_idx){
-	direction action;
-	// Map the action_idx to an action asif we are in the quadrant A:
-	switch(action_idx){
-		case 0: action = NEUTRAL; break; // stay in position
-		case 1: action = LEFT;	  break; // move away from x-axis
-		case 2: action = UP; 	  break; // move away from y-axis
-	}
-	// Check if we are in quadrant B / D
-	if (b->x_pos > 61 && action == LEFT){
-		action = RIGHT;
+void restartTelemetry(Telemetry *t){
+	int p;
+	for (p = 0; p < PHASES; p++) {
+		t->time[p] = 0;
 	}
-	// Check if we are in quadrant C / D
-	if (b->y_pos > 61 && action == UP){
-		action = DOWN;
-	}
-	
-	return action;
+	t->words = readSPICount();
+	t->reward = 0;
+	t->planned = 0;
+	t->window = 0;
 }
 
 /**
- * Returns a reward for the given state of the ball, making the center of the screen the goal state (+10),
- * the bounds of the screen very bad (-100), and every other area -1.
- * The reward structure is open for interpretation and can be toyed with to achieve different goals.
- *
- * Possible ideas: make reward based on how far the ball is away from an edge
+ * The number of simulated updates per step can be changed over the serial port:
+ * '+' and '-' add or remove 4 updates, '0' turns planning off.
+ * A LINK_SOH byte starts a block transfer session (see lib.h), in which the host can read and write
+ * the eeprom and the values of the learner. The loop is paused during the session, so the current
+ * telemetry window is dropped: its phase times would have wrapped around.
  */
-int getReward(int x, int y){
-	int reward = -1;
-	if (x == 6 && y == 6){
-		reward = 10;
-	} else if (x == 0  || y == 0 || x == 12 || y == 12) {
-   		reward = -100;
-   	}
-	return reward;
+int readCommand(int planning, Learner *q, Telemetry *t){
+	switch(USART_Poll()) {
+		case '+': planning += 4; break;
+		case '-': planning -= 4; break;
+		case '0': planning = 0; break;
+		case LINK_SOH:
+			linkSession(q->values, q->size);
+			t->window = -1;
+			break;
+		default: break;
+	}
+	if (planning < 0) planning = 0;
+	if (planning > MAX_PLANNING) planning = MAX_PLANNING;
+	return planning;
 }
 
-
 int  main() {
 	initializeBoard();
 	// Seed rand: if nothing is connected to the pins, they can pick up environmental noise (= ~ random)
-	srand(readAnalog(0)); 
-	//Create ball in the center of the screen
-	Ball* b = createBall((SCREEN_WIDTH/2)-SIZE/2,(SCREEN_HEIGHT/2)-SIZE/2, SIZE,SIZE);
-	// Draw the ball in its initial position 
-	fillRectangle(b->x_pos, b->y_pos, b->width, b->height, b->color);
-	//Set the ball to be white
-	b->color = WHITE;
-	//Create an accelerometer connected to the X and Y_PIN 
-	Accelerometer* acc = newAccelerometer(X_PIN,Y_PIN); 
+	// When replaying a trace we reuse the seed of the recording, and planning does not stop at its deadline,
+	// so the run is fully deterministic (as long as the planning is not changed over the serial port)
+	unsigned int seed = (TRACE_MODE == TRACE_REPLAY) ? traceSeed() : readAnalog(0);
+	srand(seed);
+	if (TRACE_MODE == TRACE_RECORD) traceStart(seed);
+	if (TRACE_MODE == TRACE_DUMP) traceDump();
+	// Initialize our Q-values table: (7x7x3 floats) x 4 bytes = 588 bytes, or a tile coder of the same size
+	// All agents learn in the same table, so every step gives NUM_BALLS transitions
+	// It is the largest block on the heap, so it is allocated first while the stack is still shallow:
+	// malloc refuses memory that comes closer than __malloc_margin to the stack pointer
+	Learner* q = (RL_LEARNER == LEARNER_TILES) ? newTileCoder(GAMMA) : newQTable(GAMMA);
+	if (q == NULL) {
+		USART_Transmit('!');
+		while(1);
+	}
+	//Create the balls around the center of the screen, each of them is moved by its own agent
+	const int center = (SCREEN_WIDTH/2)-SIZE/2;
+	Ball* balls[RL_BALLS];
+	int i;
+	for (i = 0; i < NUM_BALLS; i++) {
+		balls[i] = createBall(center + startOffset(i, 0), center + startOffset(i, 1), SIZE, SIZE);
+	}
+	// Draw the balls in their initial position 
+	renderBalls(balls, NUM_BALLS);
+	//Create an accelerometer connected to the X and Y_PIN, or one that replays the recorded trace
+	Accelerometer* acc = (TRACE_MODE == TRACE_REPLAY) ? newReplayAccelerometer() : newAccelerometer(X_PIN,Y_PIN); 
 		
-	// Initialize our Q-values table: (7x7x3 floats) x 4 bytes = 588 bytes
-	float qvalues[7][7][3] = {};
+	// Where every action was taken in every state, replayed while we would otherwise be waiting (149 bytes)
+	Model model = {};
+	int planning = RL_PLANNING;
+	// Decaying exploration and learning rates, and the convergence detector
+	Schedule schedule;
+	initSchedule(&schedule, RL_ADAPTIVE, RL_CONVERGED);
+	
+	Telemetry telemetry = {};
+	telemetry.words = readSPICount();
+	telemetry.schedule = &schedule;
+	telemetry.mark = readTimer();
+	telemetry.window = -1;
+	// Everything is allocated, the telemetry reports how much of the free SRAM the stack never reached
+	paintStack();
 	
 	while(1) {
-		//Ask the accelerometer for the direction
+		//Ask the accelerometer for the direction, tilting the board moves all balls
 		direction d = sendMessage(acc,getDirection);
-		moveBall(b, d, STEP);
-		_delay_ms(150);	
+		if (TRACE_MODE == TRACE_RECORD) {
+			traceRecord(d);
+			// The loop never ends, so write the buffered run now and then instead of at the end
+			if ((telemetry.steps + 1) % TRACE_FLUSH_STEPS == 0) traceFlush();
+		}
+		for (i = 0; i < NUM_BALLS; i++) {
+			moveBall(balls[i], d, STEP);
+		}
+		account(&telemetry, SENSING);
+		renderBalls(balls, NUM_BALLS);
+		account(&telemetry, RENDERING);
+		// Let the user see the move, sleeping instead of busy waiting
+		unsigned int shown = telemetry.mark + MS_TO_TICKS(150);
+		// Meanwhile the telemetry goes out, so it does not make the step longer. Every line covers the
+		// TELEMETRY_STEPS complete steps since the previous one, they are counted from this point.
+		if (TELEMETRY_STEPS > 0 && telemetry.window == TELEMETRY_STEPS) {
+			sendTelemetry(&telemetry);
+			restartTelemetry(&telemetry);
+			account(&telemetry, IO);
+		} else if (TELEMETRY_STEPS > 0 && telemetry.window < 0) {
+			restartTelemetry(&telemetry);
+		}
+		sleepUntil(shown);
+		account(&telemetry, IDLE);
 		
-		// Get the current state of the ball (defined by 2 ints, x and y, in a range of [0, 6])
-		int x, y;
-		getState(b, &x, &y);
+		for (i = 0; i < NUM_BALLS; i++) {
+			Ball* b = balls[i];
+			// Select an action for the current position, using epsilon-Greedy action selection (greedy once converged)
+			// We have to keep these 2 separate: the action index will get used to update the Q-value,
+			// While the actual action is dependent on the quadrant, and for actually moving the ball
+			int x_pos = b->x_pos;
+			int y_pos = b->y_pos;
+			int action_idx = scheduleSelect(&schedule, q, x_pos, y_pos, EPSILON);
+			direction action = getAction(b, action_idx);
 		
-		// Select an action for the current state, using epsilon-Greedy action selection
-		// We have to keep these 2 separate: the action index will get used to update the Q-value,
-		// While the actual action is dependent on the quadrant, and for actually moving the ball
-		int action_idx = selectActionIndex(qvalues[x][y], EPSILON);
-		direction action = getAction(b, action_idx);
-	
-		// Perform the action
-		moveBall(b, action, RL_STEP);
-		
-		// Get the resulting state of the ball (defined by 2 ints, x and y, in a range of [0, 6])
-		int new_x, new_y;
-		getState(b, &new_x, &new_y);
+			// Perform the action
+			moveBall(b, action, RL_STEP);
 			
-		// Get the best action index for our new state. Note that we use epsilon = 0 here, because
-		// we want te best possible action without exploration (part of the update rule, see theory)
-		int new_action_idx = selectActionIndex(qvalues[new_x][new_y], 0);
-		
-		// Get the reward and reposition if needed
-		int reward = getReward(new_x, new_y);
-		
-		// Update our q-values using the Q-learning update rule
-		qvalues[x][y][action_idx] += ALPHA * (reward + GAMMA * qvalues[new_x][new_y][new_action_idx] - qvalues[x][y][action_idx]);
+			// Get the resulting state of the ball (defined by 2 ints, x and y, in a range of [0, 6])
+			int new_x, new_y;
+			getState(b, &new_x, &new_y);
 				
-		// If our ball somehow crossed the screen bounds, we will reset it to the center position
-		if (b->y_pos > SCREEN_HEIGHT-SIZE || b->y_pos < 0 || b->x_pos > SCREEN_WIDTH-SIZE  || b->x_pos < 0) {
-			sendMessage(b, move, (SCREEN_WIDTH/2)-SIZE/2,(SCREEN_HEIGHT/2)-SIZE/2);
+			// Get the reward and reposition if needed
+			int reward = getReward(&REWARDS, new_x, new_y);
+			
+			// Update our q-values using the Q-learning update rule, unless the learner is converged
+			if (scheduleLearn(&schedule, q, x_pos, y_pos, action_idx, reward, b->x_pos, b->y_pos, ALPHA)) {
+				rememberTransition(&model, x_pos, y_pos, action_idx, b->x_pos, b->y_pos);
+			}
+					
+			// If our ball somehow crossed the screen bounds, we will reset it to its start position,
+			// not to the center: balls that share a position would only learn the same transitions
+			if (b->y_pos > SCREEN_HEIGHT-SIZE || b->y_pos < 0 || b->x_pos > SCREEN_WIDTH-SIZE  || b->x_pos < 0) {
+				sendMessage(b, place, center + startOffset(i, 0), center + startOffset(i, 1));
+			}
+			telemetry.reward += reward;
 		}
+		account(&telemetry, LEARNING);
+		// Draw the moves of all agents at once
+		renderBalls(balls, NUM_BALLS);
+		account(&telemetry, RENDERING);
+		
+		telemetry.steps++;
+		if (telemetry.window >= 0) telemetry.window++;
+		planning = readCommand(planning, q, &telemetry);
+		account(&telemetry, IO);
 		
-		_delay_ms(75);
+		// Spend the rest of the step on planning, stopping early so the step does not get any longer.
+		// A replay always does all updates: how many fit in the time must not change the run
+		unsigned int deadline = telemetry.mark + MS_TO_TICKS(75);
+		int planned = 0;
+		while (planned < planning && !schedule.converged && (TRACE_MODE == TRACE_REPLAY || ticksUntil(deadline) > 0) && planQValue(q, &model, &REWARDS, ALPHA)) {
+			planned++;
+		}
+		telemetry.planned += planned;
+		account(&telemetry, LEARNING);
+		sleepUntil(deadline);
+		account(&telemetry, IDLE);
 	}
 	//cleanup
-	free(b);
+	for (i = 0; i < NUM_BALLS; i++) {
+		free(balls[i]);
+	}
 	free(acc);
+	free(q->values);
+	free(q);
 }
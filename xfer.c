@@ -0,0 +1,334 @@
+/*
+    Host tool that moves eeprom images and learner values to and from the board.
+
+    Copyright (C) 2014 Christophe Scholliers (Software Languages Lab VUB)
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file xfer.c
+ * @brief Talks the block transfer protocol of linkSession (see lib.h) over a serial port.
+ *
+ * The session starts at BAUD. With -b the board is switched to a faster baud rate first (double speed mode,
+ * e.g. 500000 or 1000000). Every block is protected by a CRC and sent again when it is damaged or lost.
+ *
+ * Examples:
+ *   ./xfer -p /dev/ttyUSB0 -b 1000000 pull-eeprom trace.bin    (a trace for ./sweep -t trace.bin)
+ *   ./xfer -p /dev/ttyUSB0 -b 1000000 pull-learner qtable.bin
+ *   ./xfer -p /dev/ttyUSB0 push-learner qtable.bin
+ */
+
+#include "lib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#define RETRIES 8
+#define TIMEOUT_MS 500
+
+static int retransmits = 0;
+
+static speed_t speedConstant(unsigned long baud) {
+	switch (baud) {
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+#ifdef B500000
+		case 500000: return B500000;
+#endif
+#ifdef B1000000
+		case 1000000: return B1000000;
+#endif
+#ifdef B2000000
+		case 2000000: return B2000000;
+#endif
+		default: return 0;
+	}
+}
+
+static void setSpeed(int fd, unsigned long baud) {
+	struct termios tio;
+	speed_t speed = speedConstant(baud);
+	if (speed == 0) {
+		fprintf(stderr, "baud rate %lu is not supported by this host\n", baud);
+		exit(1);
+	}
+	if (tcgetattr(fd, &tio) < 0) {
+		perror("tcgetattr");
+		exit(1);
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | PARENB);
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+		perror("tcsetattr");
+		exit(1);
+	}
+}
+
+/* Same as linkCRC in lib.c */
+static unsigned int crcUpdate(unsigned int crc, unsigned char data) {
+	int i;
+	crc ^= (unsigned int)data << 8;
+	for (i = 0; i < 8; i++) {
+		crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+	}
+	return crc & 0xFFFF;
+}
+
+static int readByte(int fd, int timeout_ms) {
+	fd_set set;
+	struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	unsigned char c;
+	FD_ZERO(&set);
+	FD_SET(fd, &set);
+	if (select(fd + 1, &set, NULL, NULL, &tv) <= 0) return -1;
+	if (read(fd, &c, 1) != 1) return -1;
+	return c;
+}
+
+static void sendFrame(int fd, unsigned char cmd, unsigned int addr, const unsigned char* data, unsigned char len) {
+	unsigned char frame[1 + 4 + LINK_BLOCK + 2];
+	unsigned int crc = 0xFFFF;
+	int i;
+	frame[0] = LINK_SOH;
+	frame[1] = cmd;
+	frame[2] = addr & 0xFF;
+	frame[3] = addr >> 8;
+	frame[4] = len;
+	memcpy(frame + 5, data, len);
+	for (i = 1; i < 5 + len; i++) {
+		crc = crcUpdate(crc, frame[i]);
+	}
+	frame[5 + len] = crc & 0xFF;
+	frame[6 + len] = crc >> 8;
+	if (write(fd, frame, 7 + len) != 7 + len) {
+		perror("write");
+		exit(1);
+	}
+}
+
+/* Receives a frame: returns its command, or -1 when it is lost or damaged */
+static int receiveFrame(int fd, unsigned int* addr, unsigned char* data, unsigned char* len, int timeout_ms) {
+	unsigned char header[4];
+	unsigned int crc = 0xFFFF;
+	int c, i;
+	// Skip anything before SOH, e.g. telemetry
+	do {
+		c = readByte(fd, timeout_ms);
+		if (c < 0) return -1;
+	} while (c != LINK_SOH);
+	for (i = 0; i < 4; i++) {
+		if ((c = readByte(fd, TIMEOUT_MS)) < 0) return -1;
+		header[i] = c;
+		crc = crcUpdate(crc, c);
+	}
+	*addr = header[1] | (header[2] << 8);
+	*len = header[3];
+	if (*len > LINK_BLOCK) return -1;
+	for (i = 0; i < *len; i++) {
+		if ((c = readByte(fd, TIMEOUT_MS)) < 0) return -1;
+		data[i] = c;
+		crc = crcUpdate(crc, c);
+	}
+	int lo = readByte(fd, TIMEOUT_MS);
+	int hi = readByte(fd, TIMEOUT_MS);
+	if (lo < 0 || hi < 0 || (unsigned int)(lo | (hi << 8)) != crc) return -1;
+	return header[0];
+}
+
+/* Sends a request until the expected answer for the same address arrives, returns -1 when it is refused */
+static int request(int fd, unsigned char cmd, unsigned int addr, const unsigned char* data, unsigned char len,
+		unsigned char expect, unsigned char* reply, unsigned char* reply_len) {
+	int attempt;
+	int refused = 0;
+	for (attempt = 0; attempt < RETRIES; attempt++) {
+		unsigned int reply_addr;
+		unsigned char buffer[LINK_BLOCK];
+		unsigned char n;
+		if (attempt > 0) retransmits++;
+		sendFrame(fd, cmd, addr, data, len);
+		int answer = receiveFrame(fd, &reply_addr, buffer, &n, TIMEOUT_MS);
+		// The board also answers a damaged request with a NAK, so a NAK is only final when it keeps coming
+		refused = (answer == LINK_NAK);
+		if (answer != expect || reply_addr != addr) {
+			// Lost, damaged or stale: drop whatever is left and try again
+			tcflush(fd, TCIFLUSH);
+			continue;
+		}
+		if (reply != NULL) memcpy(reply, buffer, n);
+		if (reply_len != NULL) *reply_len = n;
+		return 0;
+	}
+	if (refused) return -1;
+	fprintf(stderr, "no answer to '%c' at %u after %d attempts\n", cmd, addr, RETRIES);
+	exit(1);
+}
+
+static void startSession(int fd, unsigned long baud) {
+	int attempt;
+	unsigned int addr;
+	unsigned char data[LINK_BLOCK];
+	unsigned char len;
+	unsigned char soh = LINK_SOH;
+	setSpeed(fd, BAUD);
+	tcflush(fd, TCIOFLUSH);
+	// The board polls the serial port once per step, keep knocking until it answers
+	for (attempt = 0; attempt < 30; attempt++) {
+		if (write(fd, &soh, 1) != 1) {
+			perror("write");
+			exit(1);
+		}
+		if (receiveFrame(fd, &addr, data, &len, 100) == LINK_ACK) break;
+	}
+	if (attempt == 30) {
+		fprintf(stderr, "the board does not answer\n");
+		exit(1);
+	}
+	if (baud == BAUD) return;
+	unsigned char rate[4] = { baud & 0xFF, (baud >> 8) & 0xFF, (baud >> 16) & 0xFF, (baud >> 24) & 0xFF };
+	if (request(fd, LINK_SPEED, 0, rate, 4, LINK_ACK, NULL, NULL) < 0) {
+		fprintf(stderr, "the board cannot reach %lu baud accurately enough\n", baud);
+		exit(1);
+	}
+	tcdrain(fd);
+	usleep(20000);
+	setSpeed(fd, baud);
+	tcflush(fd, TCIOFLUSH);
+	request(fd, LINK_PING, 0, NULL, 0, LINK_ACK, NULL, NULL);
+}
+
+static unsigned int regionSize(int fd, int eeprom) {
+	unsigned char data[LINK_BLOCK];
+	unsigned char len;
+	if (eeprom) return EEPROM_SIZE;
+	request(fd, LINK_INFO, 0, NULL, 0, LINK_DATA, data, &len);
+	return data[0] | (data[1] << 8);
+}
+
+static void pull(int fd, int eeprom, const char* path) {
+	unsigned int size = regionSize(fd, eeprom);
+	unsigned char* image = malloc(size);
+	unsigned int addr;
+	for (addr = 0; addr < size; addr += LINK_BLOCK) {
+		unsigned char count = (size - addr < LINK_BLOCK) ? size - addr : LINK_BLOCK;
+		unsigned char len;
+		if (request(fd, eeprom ? LINK_READ_EEPROM : LINK_READ_MEMORY, addr, &count, 1, LINK_DATA, image + addr, &len) < 0
+				|| len != count) {
+			fprintf(stderr, "cannot read the block at %u\n", addr);
+			exit(1);
+		}
+	}
+	FILE* f = fopen(path, "wb");
+	if (f == NULL || fwrite(image, 1, size, f) != size) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+	free(image);
+	fprintf(stderr, "pulled %u bytes to %s\n", size, path);
+}
+
+static void push(int fd, int eeprom, const char* path) {
+	unsigned int size = regionSize(fd, eeprom);
+	unsigned char* image = malloc(size + 1);
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	unsigned int length = fread(image, 1, size + 1, f);
+	fclose(f);
+	if (length != size) {
+		fprintf(stderr, "%s does not have the %u bytes the board expects\n", path, size);
+		exit(1);
+	}
+	unsigned int addr;
+	for (addr = 0; addr < size; addr += LINK_BLOCK) {
+		unsigned char count = (size - addr < LINK_BLOCK) ? size - addr : LINK_BLOCK;
+		if (request(fd, eeprom ? LINK_WRITE_EEPROM : LINK_WRITE_MEMORY, addr, image + addr, count, LINK_ACK, NULL, NULL) < 0) {
+			fprintf(stderr, "cannot write the block at %u\n", addr);
+			exit(1);
+		}
+	}
+	free(image);
+	fprintf(stderr, "pushed %u bytes from %s\n", size, path);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"usage: %s [-p port] [-b baud] command file\n"
+		"  -p port   serial port (default /dev/ttyUSB0)\n"
+		"  -b baud   baud rate of the transfer, e.g. 500000 or 1000000 (default %d)\n"
+		"  commands: pull-eeprom, push-eeprom, pull-learner, push-learner\n",
+		name, BAUD);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	const char* port = "/dev/ttyUSB0";
+	unsigned long baud = BAUD;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:b:")) != -1) {
+		switch (opt) {
+			case 'p': port = optarg; break;
+			case 'b': baud = strtoul(optarg, NULL, 10); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2) usage(argv[0]);
+	const char* command = argv[optind];
+	const char* path = argv[optind + 1];
+	int eeprom = strstr(command, "eeprom") != NULL;
+	int pulling = strncmp(command, "pull-", 5) == 0;
+	if ((!pulling && strncmp(command, "push-", 5) != 0) || (!eeprom && strstr(command, "learner") == NULL)) {
+		usage(argv[0]);
+	}
+
+	int fd = open(port, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror(port);
+		return 1;
+	}
+	struct timeval start, end;
+	startSession(fd, baud);
+	gettimeofday(&start, NULL);
+	if (pulling) {
+		pull(fd, eeprom, path);
+	} else {
+		push(fd, eeprom, path);
+	}
+	gettimeofday(&end, NULL);
+	// No retries: when the ACK is lost the board has left the session already, or leaves it after LINK_IDLE timeouts
+	unsigned int addr;
+	unsigned char data[LINK_BLOCK];
+	unsigned char len;
+	sendFrame(fd, LINK_END, 0, NULL, 0);
+	receiveFrame(fd, &addr, data, &len, TIMEOUT_MS);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	fprintf(stderr, "%.2f seconds at %lu baud, %d blocks sent again\n", seconds, baud, retransmits);
+	close(fd);
+	return 0;
+}